@@ -2,9 +2,13 @@
 
 #include <gflags/gflags.h>
 
+#include <cmath>
 #include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "./perft.h"
 #include "./search.h"
@@ -36,8 +40,6 @@ DEFINE_bool(best_move, false,
 DEFINE_bool(show_position, false,
             "Ad hoc solution not to implement game rules inside trax-daemon.");
 
-DEFINE_int32(seed, 0, "Random seed.");
-
 DEFINE_int32(perft_depth, 6, "Perft depth.");
 
 DEFINE_int32(num_games, 100, "How many times to self play.");
@@ -59,74 +61,84 @@ DEFINE_bool(
     false,
     "Finish resigned games in human game log by using searcher.");
 
+DEFINE_bool(hash_collisions, false,
+            "Report collision rate of Position::Hash() over the positions in "
+            "human game log and their children.");
+
+DECLARE_int32(perft_hash_size_lg);
+DECLARE_int32(tt_size_lg);
+
 
 namespace {
 
+// Searchers are instantiated for each rule set, so that they do not check
+// the rules on every move.
+template <RuleSet rule_set>
 Searcher *GetSearcherFromName(const std::string& name) {
   if (name == "random") {
-    return new RandomSearcher();
+    return new RandomSearcher<rule_set>();
   } else if (name == "simple-la") {
-    return new SimpleSearcher<LeafAverageEvaluator>();
+    return new SimpleSearcher<LeafAverageEvaluator, rule_set>();
   } else if (name == "simple-mc") {
-    return new SimpleSearcher<MonteCarloEvaluator>();
+    return new SimpleSearcher<MonteCarloEvaluator, rule_set>();
   } else if (name == "simple-fe") {
-    return new SimpleSearcher<FactorEvaluator>();
+    return new SimpleSearcher<FactorEvaluator, rule_set>();
   } else if (name == "simple-afe") {
-    return new SimpleSearcher<AdvancedFactorEvaluator>();
+    return new SimpleSearcher<AdvancedFactorEvaluator, rule_set>();
   } else if (name == "simple-lfe") {
-    return new SimpleSearcher<LoopFactorEvaluator>();
+    return new SimpleSearcher<LoopFactorEvaluator, rule_set>();
   } else if (name == "negamax0-la") {
-    return new NegaMaxSearcher<LeafAverageEvaluator>(0);
+    return new NegaMaxSearcher<LeafAverageEvaluator, rule_set>(0);
   } else if (name == "negamax1-la") {
-    return new NegaMaxSearcher<LeafAverageEvaluator>(1);
+    return new NegaMaxSearcher<LeafAverageEvaluator, rule_set>(1);
   } else if (name == "negamax1wb-la") {
-    return new NegaMaxSearcher<LeafAverageEvaluator>(1, false, false);
+    return new NegaMaxSearcher<LeafAverageEvaluator, rule_set>(1, false, false);
   } else if (name == "iter1-la") {
-    return new NegaMaxSearcher<LeafAverageEvaluator>(1, true);
+    return new NegaMaxSearcher<LeafAverageEvaluator, rule_set>(1, true);
   } else if (name == "negamax2-la") {
-    return new NegaMaxSearcher<LeafAverageEvaluator>(2);
+    return new NegaMaxSearcher<LeafAverageEvaluator, rule_set>(2);
   } else if (name == "iter10-la") {
-    return new NegaMaxSearcher<LeafAverageEvaluator>(10, true);
+    return new NegaMaxSearcher<LeafAverageEvaluator, rule_set>(10, true);
   } else if (name == "negamax1-mc") {
-    return new NegaMaxSearcher<MonteCarloEvaluator>(1);
+    return new NegaMaxSearcher<MonteCarloEvaluator, rule_set>(1);
   } else if (name == "negamax2-mc") {
-    return new NegaMaxSearcher<MonteCarloEvaluator>(2);
+    return new NegaMaxSearcher<MonteCarloEvaluator, rule_set>(2);
   } else if (name == "negamax0-na") {
-    return new NegaMaxSearcher<NoneEvaluator>(0);
+    return new NegaMaxSearcher<NoneEvaluator, rule_set>(0);
   } else if (name == "negamax1-na") {
-    return new NegaMaxSearcher<NoneEvaluator>(1);
+    return new NegaMaxSearcher<NoneEvaluator, rule_set>(1);
   } else if (name == "negamax2-na") {
-    return new NegaMaxSearcher<NoneEvaluator>(2);
+    return new NegaMaxSearcher<NoneEvaluator, rule_set>(2);
   } else if (name == "negamax3-na") {
-    return new NegaMaxSearcher<NoneEvaluator>(3);
+    return new NegaMaxSearcher<NoneEvaluator, rule_set>(3);
   } else if (name == "negamax4-na") {
-    return new NegaMaxSearcher<NoneEvaluator>(4);
+    return new NegaMaxSearcher<NoneEvaluator, rule_set>(4);
   } else if (name == "iter10-na") {
-    return new NegaMaxSearcher<NoneEvaluator>(10, true);
+    return new NegaMaxSearcher<NoneEvaluator, rule_set>(10, true);
   } else if (name == "negamax0-fe") {
-    return new NegaMaxSearcher<FactorEvaluator>(0);
+    return new NegaMaxSearcher<FactorEvaluator, rule_set>(0);
   } else if (name == "negamax1-fe") {
-    return new NegaMaxSearcher<FactorEvaluator>(1);
+    return new NegaMaxSearcher<FactorEvaluator, rule_set>(1);
   } else if (name == "iter1-fe") {
-    return new NegaMaxSearcher<FactorEvaluator>(1, true);
+    return new NegaMaxSearcher<FactorEvaluator, rule_set>(1, true);
   } else if (name == "iter10-fe") {
-    return new NegaMaxSearcher<FactorEvaluator>(10, true);
+    return new NegaMaxSearcher<FactorEvaluator, rule_set>(10, true);
   } else if (name == "iter10wb-fe") {
-    return new NegaMaxSearcher<FactorEvaluator>(10, true, false);
+    return new NegaMaxSearcher<FactorEvaluator, rule_set>(10, true, false);
   } else if (name == "negamax2-fe") {
-    return new NegaMaxSearcher<FactorEvaluator>(2);
+    return new NegaMaxSearcher<FactorEvaluator, rule_set>(2);
   } else if (name == "negamax3-fe") {
-    return new NegaMaxSearcher<FactorEvaluator>(3);
+    return new NegaMaxSearcher<FactorEvaluator, rule_set>(3);
   } else if (name == "negamax4-fe") {
-    return new NegaMaxSearcher<FactorEvaluator>(4);
+    return new NegaMaxSearcher<FactorEvaluator, rule_set>(4);
   } else if (name == "iter10-afe") {
-    return new NegaMaxSearcher<AdvancedFactorEvaluator>(10, true);
+    return new NegaMaxSearcher<AdvancedFactorEvaluator, rule_set>(10, true);
   } else if (name == "iter10-lfe") {
-    return new NegaMaxSearcher<LoopFactorEvaluator>(10, true);
+    return new NegaMaxSearcher<LoopFactorEvaluator, rule_set>(10, true);
   } else if (name == "itersmp-fe") {
-    return new ThreadedIterativeSearcher<FactorEvaluator>();
+    return new ThreadedIterativeSearcher<FactorEvaluator, rule_set>();
   } else if (name == "itersmp-la") {
-    return new ThreadedIterativeSearcher<LeafAverageEvaluator>();
+    return new ThreadedIterativeSearcher<LeafAverageEvaluator, rule_set>();
   } else {
     std::cerr << "cannot find searcher with name " << name << std::endl;
     exit(EXIT_FAILURE);
@@ -134,6 +146,17 @@ Searcher *GetSearcherFromName(const std::string& name) {
   }
 }
 
+Searcher *GetSearcherFromName(const std::string& name) {
+  switch (GetRuleSet()) {
+    case RULE_SET_TRAX_8X8:
+      return GetSearcherFromName<RULE_SET_TRAX_8X8>(name);
+    case RULE_SET_LOOP_TRAX:
+      return GetSearcherFromName<RULE_SET_LOOP_TRAX>(name);
+    default:
+      return GetSearcherFromName<RULE_SET_TRAX>(name);
+  }
+}
+
 void DumpGamesStatistics(const std::vector<Game>& games) {
   int loop_count = 0;
   int victory_line_count = 0;
@@ -264,31 +287,94 @@ void DumpFactors(const std::vector<Game>& games) {
   }
 }
 
+// Count positions that have the same hash but different boards, both for
+// the whole 64 bits and for the bits used as the index of
+// TranspositionTable (--tt_size_lg).
+void ReportHashCollisions(const std::vector<Game>& games) {
+  // Exact boards to tell apart positions that have the same hash.
+  std::unordered_map<PositionHash, PackedBoard> positions;
+  int num_collisions = 0;
+
+  auto add_position = [&](const Position& position) {
+    PackedBoard board(position);
+    auto inserted = positions.emplace(position.Hash(), board);
+    if (!inserted.second && inserted.first->second != board) {
+      ++num_collisions;
+    }
+  };
+
+  for (const Game& game : games) {
+    Position position;
+    for (Move move : game.moves) {
+      // Children of the positions in the game are also checked, as they are
+      // what search actually probes.
+      Position next_position;
+      for (Move possible_move : position.GenerateMoves()) {
+        if (position.DoMove(possible_move, &next_position)) {
+          add_position(next_position);
+        }
+      }
+
+      if (!position.DoMove(move, &next_position)) {
+        std::cerr << "illegal move in game" << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      position.Swap(&next_position);
+    }
+  }
+
+  const PositionHash mask = (1ULL << FLAGS_tt_size_lg) - 1;
+  std::unordered_set<PositionHash> indices;
+  for (auto& position : positions) {
+    indices.insert(position.first & mask);
+  }
+
+  // Number of occupied buckets expected for uniformly distributed hashes.
+  const double num_buckets = static_cast<double>(mask) + 1;
+  const double expected_indices = num_buckets *
+      (1.0 - std::pow(1.0 - 1.0 / num_buckets, positions.size()));
+
+  std::cerr << "Games: " << games.size() << std::endl;
+  std::cerr << "Distinct hashes: " << positions.size() << std::endl;
+  std::cerr << "64 bit collisions: " << num_collisions << std::endl;
+  std::cerr << "Distinct TT indices (" << FLAGS_tt_size_lg << " bits): "
+    << indices.size() << " (uniform: " << expected_indices << ")"
+    << std::endl;
+  std::cerr << "TT index collision rate: "
+    << 100.0 * (positions.size() - indices.size()) / positions.size()
+    << "% (uniform: "
+    << 100.0 * (positions.size() - expected_indices) / positions.size()
+    << "%)" << std::endl;
+}
+
 // Ranks searchers by simplified version of Elo rating.
 // https://en.wikipedia.org/wiki/Elo_rating_system
 //
 // The method is based on that of Shogi Club 24 or floodgate's one.
 void RunTournament() {
   Searcher *searchers[] = {
-    new RandomSearcher(),
-    new SimpleSearcher<LeafAverageEvaluator>(),
-    new SimpleSearcher<FactorEvaluator>(),
-    new NegaMaxSearcher<LeafAverageEvaluator>(1),
-    new NegaMaxSearcher<LeafAverageEvaluator>(10, true),
-    new NegaMaxSearcher<FactorEvaluator>(10, true),
-    new NegaMaxSearcher<AdvancedFactorEvaluator>(10, true)
+    GetSearcherFromName("random"),
+    GetSearcherFromName("simple-la"),
+    GetSearcherFromName("simple-fe"),
+    GetSearcherFromName("negamax1-la"),
+    GetSearcherFromName("iter10-la"),
+    GetSearcherFromName("iter10-fe"),
+    GetSearcherFromName("iter10-afe")
   };
 
   const int num_searchers = sizeof(searchers) / sizeof(searchers[0]);
   std::vector<double> rates(num_searchers, 1500.0);
 
+  // Used to pick up the players.
+  RandomGenerator random;
+
   for (int i = 0; i < FLAGS_num_games; ++i) {
     std::cerr << "Game " << i << ": ";
 
-    int white_index = Random() % num_searchers;
+    int white_index = random.Next() % num_searchers;
     int red_index = white_index;
     while (white_index == red_index) {
-      red_index = Random() % num_searchers;
+      red_index = random.Next() % num_searchers;
     }
 
     Game game;
@@ -338,21 +424,9 @@ int main(int argc, char *argv[]) {
   google::SetUsageMessage(
       "Trax artificial intelligence.\n\n"
       "usage: ./trax (--client|--perft|--prediction|--self|--use_log|"
-      "--tournament)");
+      "--tournament|--hash_collisions)");
   google::ParseCommandLineFlags(&argc, &argv, true);
 
-  // Otherwise Position::GetPossiblePieces() doesn't work.
-  GeneratePossiblePiecesTable();
-  // Otherwise Position::TraceVictoryLineOrLoop() doesn't work.
-  GenerateTrackDirectionTable();
-  // Otherwise Position::FillForcedPieces() doesn't work.
-  GenerateForcedPlayTable();
-
-  // Initialize random seed.
-  for (int i = 0; i < FLAGS_seed; ++i) {
-    Random();
-  }
-
   //// Realtime playing facilities.
 
   // These modes are for trax-daemon (Trax playing online frontend) and
@@ -386,6 +460,12 @@ int main(int argc, char *argv[]) {
   // Benchmark its performance by counting all the possible moves within
   // the given depth.
   if (FLAGS_perft) {
+    if (FLAGS_perft_hash_size_lg < 0 ||
+        FLAGS_perft_hash_size_lg > kMaxPerftHashSizeLg) {
+      std::cerr << "--perft_hash_size_lg has to be in [0, "
+        << kMaxPerftHashSizeLg << "]" << std::endl;
+      exit(EXIT_FAILURE);
+    }
     ShowPerft(FLAGS_perft_depth);
     return 0;
   }
@@ -458,6 +538,14 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
+  // Measure quality of Position::Hash().
+  if (FLAGS_hash_collisions) {
+    std::vector<Game> games;
+    ParseCommentedGames(FLAGS_commented_games, &games);
+    ReportHashCollisions(games);
+    return 0;
+  }
+
   google::ShowUsageWithFlags(argv[0]);
   std::cerr << std::endl;
   std::cerr << "Move struct size: " << sizeof(Move) << std::endl;
@@ -2,46 +2,368 @@
 
 #include "./perft.h"
 
+#include <gflags/gflags.h>
+
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <thread>  // NOLINT
+#include <vector>
+
 #include "./timer.h"
 #include "./trax.h"
 
+DEFINE_bool(perft_make_move, true,
+            "Use in place Position::MakeMove() / UnmakeMove() for perft "
+            "instead of copying positions by Position::DoMove().");
+
+DEFINE_int32(perft_threads, 0,
+             "Number of threads for perft. 0 means the number of the "
+             "hardware threads.");
+
+DEFINE_int32(perft_hash_size_lg, 0,
+             "Logarithmic size of the hash table of perft. "
+             "2^perft_hash_size_lg * sizeof(one cluster) will be allocated. "
+             "0 disables the table.");
+
+DEFINE_bool(perft_divide, false,
+            "Show the number of leaves under each root move at "
+            "--perft_depth instead of the numbers at each depth.");
+
+namespace {
+
+// Verified numbers of leaves from the initial position, indexed by depth.
+// All the rule sets have the same numbers up to depth 8.
+const uint64_t kPerftCounts[] = {
+  1, 2, 24, 432, 9568, 246888, 7209480, 233696112, 8290141664,
+};
+const int kNumPerftCounts = sizeof(kPerftCounts) / sizeof(kPerftCounts[0]);
+
+// Numbers of leaves at depth 9, where the rule sets differ. Counted by the
+// hashed perft with two sizes of the table.
+const uint64_t kTraxPerftCount9 = 318374798120;
+const uint64_t kTrax8x8PerftCount9 = 318368081192;
+const uint64_t kLoopTraxPerftCount9 = 318374811944;
+
 // Enumerate all possible positions within the given depth.
-int Perft(const Position& position, int depth, Timer *timer) {
-  // position.Dump();
+// The moves at the last depth are only counted, not made.
+template <RuleSet rule_set>
+uint64_t Perft(const Position& position, int depth) {
+  if (depth <= 0) {
+    return 1;
+  }
+
+  MoveList moves;
+  if (depth == 1) {
+    position.GenerateLegalMoves<rule_set>(&moves);
+    return moves.size();
+  }
+
+  uint64_t total_positions = 0;
+  position.GenerateMoves<rule_set>(&moves);
+
+  // Declared outside the loop so that its board buffer is reused.
+  Position next_position;
+  for (Move move : moves) {
+    if (!position.DoMove<rule_set>(move, &next_position)) {
+      // The move was illegal.
+      continue;
+    }
+    total_positions += Perft<rule_set>(next_position, depth - 1);
+  }
+  return total_positions;
+}
+
+// Same as above, but the position is updated in place.
+template <RuleSet rule_set>
+uint64_t Perft(Position* position, int depth) {
   if (depth <= 0) {
-    timer->IncrementNodeCounter();
     return 1;
   }
 
-  int total_positions = 0;
+  MoveList moves;
+  if (depth == 1) {
+    position->GenerateLegalMoves<rule_set>(&moves);
+    return moves.size();
+  }
+
+  uint64_t total_positions = 0;
+  position->GenerateMoves<rule_set>(&moves);
+  for (Move move : moves) {
+    if (!position->MakeMove<rule_set>(move)) {
+      // The move was illegal.
+      continue;
+    }
+    total_positions += Perft<rule_set>(position, depth - 1);
+    position->UnmakeMove();
+  }
+  return total_positions;
+}
+
+// Table of the number of leaves under the positions searched by perft,
+// shared by the threads without locks.
+class PerftTable {
+ public:
+  explicit PerftTable(int size_lg)
+      : mask_((size_t{1} << size_lg) - 1)
+      , clusters_(new Cluster[size_t{1} << size_lg]()) {
+    assert(0 < size_lg && size_lg <= kMaxPerftHashSizeLg);
+  }
+
+  // Return true if found.
+  bool Probe(PositionHash key, int depth, uint64_t* leaves) const {
+    const Cluster& cluster = clusters_[key & mask_];
+    for (const Entry& entry : cluster.entries) {
+      const uint64_t data = entry.data.load(std::memory_order_relaxed);
+      if ((entry.checked_key.load(std::memory_order_relaxed) ^ data) == key &&
+          static_cast<int>(data & kDepthMask) == depth) {
+        *leaves = data >> kDepthBits;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The first entry of a cluster keeps the deepest subtree, and the second
+  // one keeps the latest.
+  void Store(PositionHash key, int depth, uint64_t leaves) {
+    Cluster& cluster = clusters_[key & mask_];
+    const uint64_t data = leaves << kDepthBits | depth;
+    Entry* entry = &cluster.entries[1];
+    if (static_cast<int>(cluster.entries[0].data.load(
+            std::memory_order_relaxed) & kDepthMask) <= depth) {
+      entry = &cluster.entries[0];
+    }
+    entry->checked_key.store(key ^ data, std::memory_order_relaxed);
+    entry->data.store(data, std::memory_order_relaxed);
+  }
+
+ private:
+  static const int kDepthBits = 8;
+  static const uint64_t kDepthMask = (1 << kDepthBits) - 1;
+
+  // The key is stored xored with the data, so that an entry torn by the
+  // stores from another thread is not found.
+  struct Entry {
+    std::atomic<uint64_t> checked_key;
+    std::atomic<uint64_t> data;
+  };
+
+  struct Cluster {
+    Entry entries[2];
+  };
+
+  const uint64_t mask_;
+  std::unique_ptr<Cluster[]> clusters_;
+};
+
+// Same as Perft(Position*, int), but the numbers of the leaves are shared
+// among the transposed positions through the table.
+template <RuleSet rule_set>
+uint64_t HashedPerft(Position* position, int depth, PerftTable* table) {
+  if (depth <= 1) {
+    return Perft<rule_set>(position, depth);
+  }
+
+  const PositionHash key = position->Hash();
+  uint64_t total_positions = 0;
+  if (table->Probe(key, depth, &total_positions)) {
+    return total_positions;
+  }
 
-  for (Move move : position.GenerateMoves()) {
-    Position next_position;
-    if (!position.DoMove(move, &next_position)) {
+  MoveList moves;
+  position->GenerateMoves<rule_set>(&moves);
+  for (Move move : moves) {
+    if (!position->MakeMove<rule_set>(move)) {
       // The move was illegal.
       continue;
     }
-    total_positions += Perft(next_position, depth - 1, timer);
+    total_positions += HashedPerft<rule_set>(position, depth - 1, table);
+    position->UnmakeMove();
   }
+  table->Store(key, depth, total_positions);
   return total_positions;
 }
 
-int Perft(int depth, Timer* timer) {
-  Position position;
-  return Perft(position, depth, timer);
+// Subtree of perft searched by a thread. It is under the root move at
+// root_index, reached by the moves from the root.
+struct PerftTask {
+  int root_index;
+  Move moves[2];
+  int num_moves;
+  uint64_t leaves;
+};
+
+int GetNumPerftThreads() {
+  if (FLAGS_perft_threads > 0) {
+    return FLAGS_perft_threads;
+  }
+  return std::max(1U, std::thread::hardware_concurrency());
+}
+
+template <RuleSet rule_set>
+uint64_t Perft(int depth, Timer* timer,
+               std::vector<std::pair<Move, uint64_t>>* divide) {
+  Position root;
+  MoveList root_moves;
+  root.GenerateLegalMoves<rule_set>(&root_moves);
+  if (divide != nullptr) {
+    divide->clear();
+    for (Move move : root_moves) {
+      divide->emplace_back(move, 0);
+    }
+  }
+
+  if (depth <= 1) {
+    const uint64_t leaves = depth <= 0 ? 1 : root_moves.size();
+    if (divide != nullptr && depth == 1) {
+      for (auto& root_move : *divide) {
+        root_move.second = 1;
+      }
+    }
+    timer->IncrementNodeCounter(leaves);
+    return leaves;
+  }
+
+  // Split the tree at the depth 2, which gives hundreds of subtrees to
+  // balance among the threads. The tree of depth 2 is split at the root.
+  std::vector<PerftTask> tasks;
+  MoveList moves;
+  for (int i = 0; i < root_moves.size(); ++i) {
+    if (depth == 2) {
+      tasks.push_back({i, {root_moves[i]}, 1, 0});
+      continue;
+    }
+    const bool legal = root.MakeMove<rule_set>(root_moves[i]);
+    assert(legal);
+    root.GenerateLegalMoves<rule_set>(&moves);
+    for (Move move : moves) {
+      tasks.push_back({i, {root_moves[i], move}, 2, 0});
+    }
+    root.UnmakeMove();
+  }
+
+  std::unique_ptr<PerftTable> table;
+  if (FLAGS_perft_hash_size_lg > 0) {
+    table.reset(new PerftTable(FLAGS_perft_hash_size_lg));
+  }
+
+  std::atomic<int> next_task(0);
+  auto worker = [&]() {
+    Position position;
+    const int num_tasks = tasks.size();
+    for (int i = next_task++; i < num_tasks; i = next_task++) {
+      PerftTask& task = tasks[i];
+      root.CopyTo(&position);
+      for (int j = 0; j < task.num_moves; ++j) {
+        const bool legal = position.MakeMove<rule_set>(task.moves[j]);
+        assert(legal);
+      }
+      const int remaining_depth = depth - task.num_moves;
+      if (table) {
+        task.leaves = HashedPerft<rule_set>(&position, remaining_depth,
+                                            table.get());
+      } else if (FLAGS_perft_make_move) {
+        task.leaves = Perft<rule_set>(&position, remaining_depth);
+      } else {
+        task.leaves = Perft<rule_set>(
+            static_cast<const Position&>(position), remaining_depth);
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 1; i < GetNumPerftThreads(); ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  uint64_t total_positions = 0;
+  for (const PerftTask& task : tasks) {
+    total_positions += task.leaves;
+    if (divide != nullptr) {
+      (*divide)[task.root_index].second += task.leaves;
+    }
+  }
+  timer->IncrementNodeCounter(total_positions);
+  return total_positions;
+}
+
+}  // namespace
+
+uint64_t Perft(int depth, Timer* timer,
+               std::vector<std::pair<Move, uint64_t>>* divide) {
+  switch (GetRuleSet()) {
+    case RULE_SET_TRAX_8X8:
+      return Perft<RULE_SET_TRAX_8X8>(depth, timer, divide);
+    case RULE_SET_LOOP_TRAX:
+      return Perft<RULE_SET_LOOP_TRAX>(depth, timer, divide);
+    default:
+      return Perft<RULE_SET_TRAX>(depth, timer, divide);
+  }
+}
+
+bool GetPerftReference(RuleSet rule_set, int depth, uint64_t* leaves) {
+  if (depth < 0 || depth > kNumPerftCounts) {
+    return false;
+  }
+  if (depth < kNumPerftCounts) {
+    *leaves = kPerftCounts[depth];
+    return true;
+  }
+
+  switch (rule_set) {
+    case RULE_SET_TRAX_8X8:
+      *leaves = kTrax8x8PerftCount9;
+      break;
+    case RULE_SET_LOOP_TRAX:
+      *leaves = kLoopTraxPerftCount9;
+      break;
+    default:
+      *leaves = kTraxPerftCount9;
+      break;
+  }
+  return true;
 }
 
 void ShowPerft(int max_depth) {
-  uint64_t sum_leaves = 0;
+  if (FLAGS_perft_divide) {
+    Timer timer;
+    std::vector<std::pair<Move, uint64_t>> divide;
+    const uint64_t leaves = Perft(max_depth, &timer, &divide);
+    timer.CheckTimeout();
+    for (const auto& root_move : divide) {
+      std::cerr << root_move.first.notation() << ": " << root_move.second
+        << std::endl;
+    }
+    std::cerr
+      << "Depth: " << max_depth << " leaves: " << leaves
+      << " Time: " << timer.elapsed_ms() << "ms" << std::endl;
+    return;
+  }
+
   for (int i_depth = 0; i_depth <= max_depth; ++i_depth) {
     Timer timer;
-    const int leaves = Perft(i_depth, &timer);
+    const uint64_t leaves = Perft(i_depth, &timer);
     timer.CheckTimeout();
-    sum_leaves += leaves;
 
     std::cerr
       << "Depth: " << i_depth << " leaves: " << leaves
       << " Time: " << timer.elapsed_ms() << "ms"
-      << " Speed: " << timer.nps() << " node/s " << std::endl;
+      << " Speed: " << timer.nps() << " node/s ";
+
+    uint64_t expected_leaves;
+    if (GetPerftReference(GetRuleSet(), i_depth, &expected_leaves)) {
+      if (leaves == expected_leaves) {
+        std::cerr << "OK";
+      } else {
+        std::cerr << "MISMATCH (expected " << expected_leaves << ")";
+      }
+    }
+    std::cerr << std::endl;
   }
 }
@@ -3,14 +3,34 @@
 #ifndef PERFT_H_
 #define PERFT_H_
 
+#include <cstdint>
+#include <utility>
+#include <vector>
+
 #include "./timer.h"
+#include "./trax.h"
+
+// Largest --perft_hash_size_lg accepted. The table of 2^30 clusters takes
+// 32GB already.
+const int kMaxPerftHashSizeLg = 30;
 
 // Do performance testing by counting all the possible moves
-// within the given depth.
-int Perft(int depth, Timer* timer);
+// within the given depth. The tree is split into subtrees searched by
+// --perft_threads threads, and the moves at the last depth are only
+// counted. With --perft_hash_size_lg, the subtrees of the transposed
+// positions are counted once through a hash table shared by the threads.
+// The number of the leaves under each root move is stored to divide if it
+// is not nullptr.
+uint64_t Perft(int depth, Timer* timer,
+               std::vector<std::pair<Move, uint64_t>>* divide = nullptr);
 
-// Show results of perft between 0<=depth<=max_depth in readable format.
+// Return true and store the verified number of the leaves at the depth from
+// the initial position if it is known.
+bool GetPerftReference(RuleSet rule_set, int depth, uint64_t* leaves);
+
+// Show results of perft between 0<=depth<=max_depth in readable format,
+// checked against the reference. With --perft_divide, show the leaves
+// under each root move at max_depth instead.
 void ShowPerft(int max_depth);
 
 #endif  // PERFT_H_
-
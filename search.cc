@@ -12,32 +12,200 @@
 #include "./timer.h"
 #include "./trax.h"
 
+constexpr int SearchStack::kMaxPly;
+constexpr int SearchStack::kMaxDepth;
+constexpr int SearchStack::kMaxHistory;
 
-Move RandomSearcher::SearchBestMove(const Position& position, Timer* timer) {
-  std::vector<Move> legal_moves;
-  for (Move move : position.GenerateMoves()) {
-    Position next_position;
-    if (position.DoMove(move, &next_position)) {
-      // The move is proved to be legal.
-      legal_moves.push_back(move);
+namespace {
+
+// Sort the moves by their scores in the descending order, keeping the order
+// of the moves with the same score. Insertion sort is used, which is fast
+// enough for the short lists and does not allocate.
+void SortMoves(std::vector<ScoredMove>* scored_moves, MoveList* moves) {
+  assert(static_cast<int>(scored_moves->size()) == moves->size());
+  const int num_moves = scored_moves->size();
+  for (int i = 1; i < num_moves; ++i) {
+    const ScoredMove scored_move = (*scored_moves)[i];
+    int j = i;
+    for (; j > 0 && (*scored_moves)[j - 1].score < scored_move.score; --j) {
+      (*scored_moves)[j] = (*scored_moves)[j - 1];
+    }
+    (*scored_moves)[j] = scored_move;
+  }
+
+  for (int i = 0; i < num_moves; ++i) {
+    (*moves)[i] = (*scored_moves)[i].move;
+  }
+}
+
+// Pick the moves of the position at the ply one by one in the order they
+// are likely to cause beta cutoffs, in stages:
+//
+// 1. The best move in the transposition table and the killer moves of the
+//    ply, which are checked by IsPossibleMove() and IsLegalMove().
+// 2. The rest of the unique moves, sorted by the history. They are only
+//    generated when the moves of the first stage did not cause a cutoff.
+//
+// A generated move that results in the same position as a move of the first
+// stage is picked again, but it is rare and cut by the transposition table.
+// The position has to be restored whenever Next() is called.
+template <RuleSet rule_set>
+class MovePicker {
+ public:
+  MovePicker(const Position& position, Move tt_move, SearchStack* stack,
+             int ply)
+      : position_(position)
+      , stack_(stack)
+      , frame_(stack->frame(ply))
+      , stage_(STAGE_FIRST_MOVES)
+      , candidates_{tt_move, frame_->killers[0], frame_->killers[1]}
+      , num_first_moves_(0)
+      , candidate_index_(0)
+      , move_index_(0) {
+  }
+
+  // Store the next legal move to move. Return false if no moves are left.
+  bool Next(Move* move) {
+    if (stage_ == STAGE_FIRST_MOVES) {
+      while (candidate_index_ < kNumCandidates) {
+        const Move candidate = candidates_[candidate_index_++];
+        if (!IsFirstMove(candidate) &&
+            position_.IsPossibleMove<rule_set>(candidate) &&
+            position_.IsLegalMove<rule_set>(candidate)) {
+          first_moves_[num_first_moves_++] = candidate;
+          *move = candidate;
+          return true;
+        }
+      }
+      GenerateRemainingMoves();
+      stage_ = STAGE_REMAINING_MOVES;
+    }
+
+    if (move_index_ >= frame_->moves.size()) {
+      return false;
+    }
+    *move = frame_->moves[move_index_++];
+    return true;
+  }
+
+  // Number of the moves returned by Next().
+  int num_picked() const {
+    return num_first_moves_ + move_index_;
+  }
+
+  // The i-th move returned by Next().
+  Move picked(int i) const {
+    assert(0 <= i && i < num_picked());
+    if (i < num_first_moves_) {
+      return first_moves_[i];
+    }
+    return frame_->moves[i - num_first_moves_];
+  }
+
+ private:
+  enum Stage {
+    STAGE_FIRST_MOVES,
+    STAGE_REMAINING_MOVES
+  };
+
+  // The best move in the transposition table and the two killer moves.
+  static const int kNumCandidates = 3;
+
+  bool IsFirstMove(Move move) const {
+    for (int i = 0; i < num_first_moves_; ++i) {
+      if (first_moves_[i] == move) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void GenerateRemainingMoves() {
+    MoveList& moves = frame_->moves;
+    position_.GenerateUniqueMoves<rule_set>(&moves);
+
+    std::vector<ScoredMove>& scored_moves = frame_->scored_moves;
+    scored_moves.clear();
+    int num_moves = 0;
+    for (Move move : moves) {
+      if (IsFirstMove(move)) {
+        continue;
+      }
+      moves[num_moves++] = move;
+      scored_moves.emplace_back(stack_->history(move), move);
     }
+    moves.resize(num_moves);
+    SortMoves(&scored_moves, &moves);
+  }
+
+  const Position& position_;
+  SearchStack* stack_;
+  SearchStack::Frame* frame_;
+  Stage stage_;
+
+  Move candidates_[kNumCandidates];
+
+  // Legal moves among the candidates, in the order they were picked.
+  Move first_moves_[kNumCandidates];
+  int num_first_moves_;
+
+  int candidate_index_;
+
+  // Index of the next move in frame_->moves.
+  int move_index_;
+};
+
+// Remember the last move picked by the picker, which caused a beta cutoff
+// at the ply, as a killer move. The history rewards it and penalizes the
+// moves picked before it.
+template <RuleSet rule_set>
+void UpdateMoveOrdering(SearchStack* stack, int ply, int depth,
+                        const MovePicker<rule_set>& picker) {
+  const Move cutoff_move = picker.picked(picker.num_picked() - 1);
+  SearchStack::Frame* frame = stack->frame(ply);
+  if (!(frame->killers[0] == cutoff_move)) {
+    frame->killers[1] = frame->killers[0];
+    frame->killers[0] = cutoff_move;
+  }
+
+  const int bonus = std::min(depth * depth, SearchStack::kMaxHistory);
+  stack->UpdateHistory(cutoff_move, bonus);
+  for (int i = 0; i < picker.num_picked() - 1; ++i) {
+    stack->UpdateHistory(picker.picked(i), -bonus);
   }
+}
+
+}  // namespace
+
+template<RuleSet rule_set>
+Move RandomSearcher<rule_set>::SearchBestMove(const Position& position,
+                                              Timer* timer) {
+  MoveList legal_moves;
+  position.GenerateLegalMoves<rule_set>(&legal_moves);
   assert(legal_moves.size() > 0);
-  return legal_moves[Random() % legal_moves.size()];
+  return legal_moves[random_.Next() % legal_moves.size()];
 }
 
 // Return the best move from the perspective of position.red_to_move().
-template<typename Evaluator>
-Move SimpleSearcher<Evaluator>::SearchBestMove(const Position& position,
-                                               Timer *timer) {
+template<typename Evaluator, RuleSet rule_set>
+Move SimpleSearcher<Evaluator, rule_set>::SearchBestMove(
+    const Position& position, Timer *timer) {
   assert(!position.finished());
 
+  SearchStack::Frame* frame = stack_.frame(0);
+
   int best_score = -kInf;
-  std::vector<ScoredMove> moves;
+  std::vector<ScoredMove>& moves = frame->scored_moves;
+  moves.clear();
+
+  MoveList& possible_moves = frame->moves;
+  position.GenerateMoves<rule_set>(&possible_moves);
+
+  Position& next_position = frame->position;
+  position.CopyTo(&next_position);
 
-  for (Move move : position.GenerateMoves()) {
-    Position next_position;
-    if (!position.DoMove(move, &next_position)) {
+  for (Move move : possible_moves) {
+    if (!next_position.MakeMove<rule_set>(move)) {
       // This is illegal move.
       continue;
     }
@@ -46,7 +214,9 @@ Move SimpleSearcher<Evaluator>::SearchBestMove(const Position& position,
     // Evaluate() evaluates from the perspective of next_position.
     // Therefore, position that is good for next_position.red_to_move() is
     // bad for position.red_to_move().
-    const int score = -Evaluator::Evaluate(next_position);
+    const int score =
+        -Evaluator::template Evaluate<rule_set>(next_position, &stack_, 1);
+    next_position.UnmakeMove();
 #if 0
     std::cerr << score << " " << move.notation() << std::endl;
 #endif
@@ -54,7 +224,7 @@ Move SimpleSearcher<Evaluator>::SearchBestMove(const Position& position,
     moves.emplace_back(score, move);
   }
 
-  std::vector<Move> best_moves;
+  MoveList best_moves;
   for (ScoredMove& move : moves) {
     if (move.score == best_score) {
       best_moves.push_back(move);
@@ -62,60 +232,58 @@ Move SimpleSearcher<Evaluator>::SearchBestMove(const Position& position,
   }
 
   assert(best_moves.size() > 0);
-  return best_moves[Random() % best_moves.size()];
+  return best_moves[stack_.random()->Next() % best_moves.size()];
 }
 
 // Return the best move from the perspective of position.red_to_move().
-template<typename Evaluator>
-Move NegaMaxSearcher<Evaluator>::SearchBestMove(const Position& position,
-                                                Timer* timer) {
+template<typename Evaluator, RuleSet rule_set>
+Move NegaMaxSearcher<Evaluator, rule_set>::SearchBestMove(
+    const Position& position, Timer* timer) {
   assert(!position.finished());
 
   Move book_move;
-  if (book_.Select(position, &book_move)) {
+  if (book_.Select(position, stack_.random(), &book_move)) {
     return book_move;
   }
 
   transposition_table_.NewSearch();
+  stack_.NewSearch();
 
-  if (iterative_) {
-    std::vector<Move> possible_moves = position.GenerateMoves();
-
-    Move best_move;
-    for (int current_depth = 0; current_depth <= max_depth_; ++current_depth) {
-      int best_score = -kInf;
-      std::vector<ScoredMove> moves;
-
-      bool aborted = false;
-
-      for (Move move : possible_moves) {
-        Position next_position;
-        if (!position.DoMove(move, &next_position)) {
-          // This is illegal move.
-          continue;
-        }
+  SearchStack::Frame* frame = stack_.frame(0);
 
-        // next_position.red_to_move() == !position.red_to_move() holds.
-        // NegaMax() evaluates from the perspective of next_position.
-        // Therefore, position that is good for next_position.red_to_move() is
-        // bad for position.red_to_move().
-        const int score = -NegaMax(next_position, timer, current_depth);
+  // Moves are applied in place to this copy.
+  Position& next_position = frame->position;
+  position.CopyTo(&next_position);
 
-        best_score = std::max(best_score, score);
-        moves.emplace_back(score, move);
+  if (iterative_) {
+    MoveList& possible_moves = frame->moves;
+    position.GenerateUniqueMoves<rule_set>(&possible_moves);
 
-        if (current_depth > 0 && timer->CheckTimeout()) {
-          aborted = true;
-          break;
-        }
-      }
+    // next_position.red_to_move() == !position.red_to_move() holds.
+    // NegaMax() evaluates from the perspective of next_position.
+    // Therefore, position that is good for next_position.red_to_move() is
+    // bad for position.red_to_move().
+    int current_depth = 0;
+    auto search = [&](Position* next, int alpha, int beta) {
+      return -NegaMax(next, timer, 1, current_depth, -beta, -alpha);
+    };
 
-      if (aborted) {
+    Move best_move;
+    int previous_score = 0;
+    for (; current_depth <= max_depth_; ++current_depth) {
+      std::vector<ScoredMove>& moves = frame->scored_moves;
+      int best_score = 0;
+      if (!SearchRootMoves<rule_set>(
+              possible_moves, previous_score,
+              /* aspiration = */ current_depth > 0,
+              /* check_timeout = */ current_depth > 0, timer, &next_position,
+              search, &moves, &best_score)) {
         // Drop the result of that iteration.
         break;
       }
+      previous_score = best_score;
 
-      std::vector<Move> best_moves;
+      MoveList best_moves;
       for (ScoredMove& move : moves) {
         if (move.score == best_score) {
           best_moves.push_back(move);
@@ -123,7 +291,10 @@ Move NegaMaxSearcher<Evaluator>::SearchBestMove(const Position& position,
       }
 
       assert(best_moves.size() > 0);
-      best_move = best_moves[Random() % best_moves.size()];
+      best_move = best_moves[stack_.random()->Next() % best_moves.size()];
+
+      // The best moves of this iteration are searched first in the next.
+      SortMoves(&moves, &possible_moves);
 
       timer->set_completed_depth(current_depth);
     }
@@ -131,26 +302,28 @@ Move NegaMaxSearcher<Evaluator>::SearchBestMove(const Position& position,
     return best_move;
   } else {
     int best_score = -kInf;
-    std::vector<ScoredMove> moves;
+    std::vector<ScoredMove>& moves = frame->scored_moves;
+    moves.clear();
 
-    for (Move move : position.GenerateMoves()) {
-      Position next_position;
-      if (!position.DoMove(move, &next_position)) {
-        // This is illegal move.
-        continue;
-      }
+    MoveList& possible_moves = frame->moves;
+    position.GenerateUniqueMoves<rule_set>(&possible_moves);
+
+    for (Move move : possible_moves) {
+      const bool legal = next_position.MakeMove<rule_set>(move);
+      assert(legal);
 
       // next_position.red_to_move() == !position.red_to_move() holds.
       // NegaMax() evaluates from the perspective of next_position.
       // Therefore, position that is good for next_position.red_to_move() is
       // bad for position.red_to_move().
-      const int score = -NegaMax(next_position, timer, max_depth_);
+      const int score = -NegaMax(&next_position, timer, 1, max_depth_);
+      next_position.UnmakeMove();
 
       best_score = std::max(best_score, score);
       moves.emplace_back(score, move);
     }
 
-    std::vector<Move> best_moves;
+    MoveList best_moves;
     for (ScoredMove& move : moves) {
       if (move.score == best_score) {
         best_moves.push_back(move);
@@ -160,7 +333,7 @@ Move NegaMaxSearcher<Evaluator>::SearchBestMove(const Position& position,
     timer->set_completed_depth(max_depth_);
 
     assert(best_moves.size() > 0);
-    return best_moves[Random() % best_moves.size()];
+    return best_moves[stack_.random()->Next() % best_moves.size()];
   }
 }
 
@@ -175,19 +348,33 @@ int AbsoluteDecrement(int x) {
   }
 }
 
+// Return the largest x such that AbsoluteDecrement(x) <= score, i.e.
+// AbsoluteDecrement(x) > score if and only if x is larger than it.
+int AbsoluteDecrementBound(int score) {
+  return score >= 0 ? score + 1 : score - 1;
+}
+
 // Score the move from the perspective of position.red_to_move().
 // Larger is better.
-template<typename Evaluator>
-int NegaMaxSearcher<Evaluator>::NegaMax(
-    const Position& position, Timer* timer, int depth, int alpha, int beta) {
+template<typename Evaluator, RuleSet rule_set>
+int NegaMaxSearcher<Evaluator, rule_set>::NegaMax(
+    Position* position, Timer* timer, int ply, int depth, int alpha,
+    int beta) {
   const int original_alpha = alpha;
 
   TranspositionTable::Entry entry;
 
   // At that point of time, we don't care about conflicts.
-  const PositionHash key = position.Hash();
+  // The rotated, reflected and color swapped positions share the entry, and
+  // its best move is stored on the canonical position.
+  int symmetry = 0;
+  const PositionHash key = position->CanonicalHash(&symmetry);
 
   const bool found = transposition_table_.Probe(key, &entry);
+  if (found) {
+    entry.best_move = position->InverseTransformMove(entry.best_move,
+                                                     symmetry);
+  }
 
   if (found && entry.depth >= depth) {
     if (entry.bound == BOUND_EXACT) {
@@ -203,30 +390,52 @@ int NegaMaxSearcher<Evaluator>::NegaMax(
     }
   }
 
+  // Tried first if it is found.
+  const Move tt_move = entry.best_move;
+
   entry.score = -kInf;
   entry.best_move = Move();
 
-  if (position.finished() || depth <= 0) {
+  if (position->finished() || depth <= 0) {
     // Evaluate the position, from the perspective of position.red_to_move(),
     // and this is same as NegaMax().
     // Thus, there is no need for sign flip.
-    entry.score = Evaluator::Evaluate(position);
+    entry.score = Evaluator::template Evaluate<rule_set>(*position, &stack_,
+                                                         ply);
 
     timer->IncrementNodeCounter();
   } else {
-    for (Move move : position.GenerateMoves()) {
-      Position next_position;
-      if (!position.DoMove(move, &next_position)) {
-        // This is illegal move.
-        continue;
-      }
-
+    // Moves that result in the same position are searched only once. The
+    // rest of the moves are not generated if the first ones cause a cutoff.
+    MovePicker<rule_set> picker(*position, tt_move, &stack_, ply);
+    Move move;
+    while (picker.Next(&move)) {
+      const bool legal = position->MakeMove<rule_set>(move);
+      assert(legal);
+
+      // The position is now the next position, and
       // next_position.red_to_move() == !position.red_to_move() holds.
       // NegaMax() evaluates from the perspective of next_position.
       // Therefore, position that is good for next_position.red_to_move() is
       // bad for position.red_to_move().
-      const int score = AbsoluteDecrement(
-          -NegaMax(next_position, timer, depth - 1, -beta, -alpha));
+      int score = 0;
+      if (picker.num_picked() == 1) {
+        score = AbsoluteDecrement(
+            -NegaMax(position, timer, ply + 1, depth - 1, -beta, -alpha));
+      } else {
+        // Principal variation search. The later moves are searched with a
+        // null window to prove that they are not better than alpha, and
+        // searched again with the window if they are.
+        const int bound = AbsoluteDecrementBound(alpha);
+        score = -NegaMax(position, timer, ply + 1, depth - 1, -bound - 1,
+                         -bound);
+        if (score > bound && beta - alpha > 1) {
+          score = -NegaMax(position, timer, ply + 1, depth - 1, -beta,
+                           -alpha);
+        }
+        score = AbsoluteDecrement(score);
+      }
+      position->UnmakeMove();
 
       // The reason why we used AbsoluteDecrement here is to finish the game
       // as early as possible.
@@ -240,7 +449,8 @@ int NegaMaxSearcher<Evaluator>::NegaMax(
 
       alpha = std::max(alpha, score);
       if (alpha >= beta) {
-       break;
+        UpdateMoveOrdering(&stack_, ply, depth, picker);
+        break;
       }
 
       if (timer->CheckTimeout()) {
@@ -260,18 +470,19 @@ int NegaMaxSearcher<Evaluator>::NegaMax(
   }
 
   transposition_table_.Store(
-      key, entry.best_move, entry.score, entry.depth, entry.bound);
+      key, position->TransformMove(entry.best_move, symmetry), entry.score,
+      entry.depth, entry.bound);
 
   return entry.score;
 }
 
-template<typename Evaluator>
-Move ThreadedIterativeSearcher<Evaluator>::SearchBestMove(
+template<typename Evaluator, RuleSet rule_set>
+Move ThreadedIterativeSearcher<Evaluator, rule_set>::SearchBestMove(
     const Position& position, Timer* timer) {
   assert(!position.finished());
 
   Move book_move;
-  if (book_.Select(position, &book_move)) {
+  if (book_.Select(position, &random_, &book_move)) {
     return book_move;
   }
 
@@ -296,52 +507,53 @@ static const std::vector<int> kDepthDensityMatrix[] = {
   {1, 0, 0, 0, 1, 1}
 };
 
-template<typename Evaluator>
-void ThreadedIterativeSearcher<Evaluator>::DoSearchBestMove(
+template<typename Evaluator, RuleSet rule_set>
+void ThreadedIterativeSearcher<Evaluator, rule_set>::DoSearchBestMove(
     const Position& position, int thread_index, int num_threads,
-    Timer* timer, Move* best_move, int* best_score, int* completed_depth) {
-  std::vector<Move> possible_moves = position.GenerateMoves();
-
-  for (int current_depth = 0; ; ++current_depth) {
+    Timer* timer, SearchStack* stack,
+    Move* best_move, int* best_score, int* completed_depth) {
+  stack->NewSearch();
+
+  SearchStack::Frame* frame = stack->frame(0);
+
+  MoveList& possible_moves = frame->moves;
+  position.GenerateUniqueMoves<rule_set>(&possible_moves);
+
+  // Moves are applied in place to this per-thread copy.
+  Position& next_position = frame->position;
+  position.CopyTo(&next_position);
+
+  // next_position.red_to_move() == !position.red_to_move() holds.
+  // NegaMax() evaluates from the perspective of next_position.
+  // Therefore, position that is good for next_position.red_to_move() is
+  // bad for position.red_to_move().
+  int current_depth = 0;
+  auto search = [&](Position* next, int alpha, int beta) {
+    return -NegaMax(next, timer, stack, 1, current_depth, -beta, -alpha);
+  };
+
+  int previous_score = 0;
+  for (; current_depth <= SearchStack::kMaxDepth; ++current_depth) {
     // Skip different depths for each thread using density matrix.
     // auto& row = kDepthDensityMatrix[thread_index];
     // if (!row[current_depth % row.size()]) {
     //   continue;
     // }
 
-    *best_score = -kInf;
-    std::vector<ScoredMove> moves;
-
-    bool aborted = false;
-
-    for (Move move : possible_moves) {
-      Position next_position;
-      if (!position.DoMove(move, &next_position)) {
-        // This is illegal move.
-        continue;
-      }
-
-      // next_position.red_to_move() == !position.red_to_move() holds.
-      // NegaMax() evaluates from the perspective of next_position.
-      // Therefore, position that is good for next_position.red_to_move() is
-      // bad for position.red_to_move().
-      const int score = -NegaMax(next_position, timer, current_depth);
-
-      *best_score = std::max(*best_score, score);
-      moves.emplace_back(score, move);
-
-      if (current_depth > 0 && timer->CheckTimeout()) {
-        aborted = true;
-        break;
-      }
-    }
-
-    if (aborted) {
+    std::vector<ScoredMove>& moves = frame->scored_moves;
+    int score = 0;
+    if (!SearchRootMoves<rule_set>(
+            possible_moves, previous_score,
+            /* aspiration = */ current_depth > 0,
+            /* check_timeout = */ current_depth > 0, timer, &next_position,
+            search, &moves, &score)) {
       // Drop the result of that iteration.
       break;
     }
+    previous_score = score;
+    *best_score = score;
 
-    std::vector<Move> best_moves;
+    MoveList best_moves;
     for (ScoredMove& move : moves) {
       if (move.score == *best_score) {
         best_moves.push_back(move);
@@ -349,7 +561,10 @@ void ThreadedIterativeSearcher<Evaluator>::DoSearchBestMove(
     }
 
     assert(best_moves.size() > 0);
-    *best_move = best_moves[Random() % best_moves.size()];
+    *best_move = best_moves[stack->random()->Next() % best_moves.size()];
+
+    // The best moves of this iteration are searched first in the next.
+    SortMoves(&moves, &possible_moves);
 
     timer->set_completed_depth(current_depth);
     *completed_depth = current_depth;
@@ -358,17 +573,25 @@ void ThreadedIterativeSearcher<Evaluator>::DoSearchBestMove(
 
 // Score the move from the perspective of position.red_to_move().
 // Larger is better.
-template<typename Evaluator>
-int ThreadedIterativeSearcher<Evaluator>::NegaMax(
-    const Position& position, Timer* timer, int depth, int alpha, int beta) {
+template<typename Evaluator, RuleSet rule_set>
+int ThreadedIterativeSearcher<Evaluator, rule_set>::NegaMax(
+    Position* position, Timer* timer, SearchStack* stack, int ply,
+    int depth, int alpha, int beta) {
   const int original_alpha = alpha;
 
   TranspositionTable::Entry entry;
 
   // At that point of time, we don't care about conflicts.
-  const PositionHash key = position.Hash();
+  // The rotated, reflected and color swapped positions share the entry, and
+  // its best move is stored on the canonical position.
+  int symmetry = 0;
+  const PositionHash key = position->CanonicalHash(&symmetry);
 
   const bool found = transposition_table_.Probe(key, &entry);
+  if (found) {
+    entry.best_move = position->InverseTransformMove(entry.best_move,
+                                                     symmetry);
+  }
 
   if (found && entry.depth >= depth) {
     if (entry.bound == BOUND_EXACT) {
@@ -384,30 +607,50 @@ int ThreadedIterativeSearcher<Evaluator>::NegaMax(
     }
   }
 
+  // Tried first if it is found.
+  const Move tt_move = entry.best_move;
+
   entry.score = -kInf;
   entry.best_move = Move();
 
-  if (position.finished() || depth <= 0) {
+  if (position->finished() || depth <= 0) {
     // Evaluate the position, from the perspective of position.red_to_move(),
     // and this is same as NegaMax().
     // Thus, there is no need for sign flip.
-    entry.score = Evaluator::Evaluate(position);
+    entry.score = Evaluator::template Evaluate<rule_set>(*position, stack, ply);
 
     timer->IncrementNodeCounter();
   } else {
-    for (Move move : position.GenerateMoves()) {
-      Position next_position;
-      if (!position.DoMove(move, &next_position)) {
-        // This is illegal move.
-        continue;
-      }
-
+    // Moves that result in the same position are searched only once. The
+    // rest of the moves are not generated if the first ones cause a cutoff.
+    MovePicker<rule_set> picker(*position, tt_move, stack, ply);
+    Move move;
+    while (picker.Next(&move)) {
+      const bool legal = position->MakeMove<rule_set>(move);
+      assert(legal);
+
+      // The position is now the next position, and
       // next_position.red_to_move() == !position.red_to_move() holds.
       // NegaMax() evaluates from the perspective of next_position.
       // Therefore, position that is good for next_position.red_to_move() is
       // bad for position.red_to_move().
-      const int score = AbsoluteDecrement(
-          -NegaMax(next_position, timer, depth - 1, -beta, -alpha));
+      int score = 0;
+      if (picker.num_picked() == 1) {
+        score = AbsoluteDecrement(
+            -NegaMax(position, timer, stack, ply + 1, depth - 1, -beta,
+                     -alpha));
+      } else {
+        // Principal variation search. See NegaMaxSearcher::NegaMax().
+        const int bound = AbsoluteDecrementBound(alpha);
+        score = -NegaMax(position, timer, stack, ply + 1, depth - 1,
+                         -bound - 1, -bound);
+        if (score > bound && beta - alpha > 1) {
+          score = -NegaMax(position, timer, stack, ply + 1, depth - 1, -beta,
+                           -alpha);
+        }
+        score = AbsoluteDecrement(score);
+      }
+      position->UnmakeMove();
 
       // The reason why we used AbsoluteDecrement here is to finish the game
       // as early as possible.
@@ -421,7 +664,8 @@ int ThreadedIterativeSearcher<Evaluator>::NegaMax(
 
       alpha = std::max(alpha, score);
       if (alpha >= beta) {
-       break;
+        UpdateMoveOrdering(stack, ply, depth, picker);
+        break;
       }
 
       if (timer->CheckTimeout(/* allow_false_negative = */true)) {
@@ -441,7 +685,8 @@ int ThreadedIterativeSearcher<Evaluator>::NegaMax(
   }
 
   transposition_table_.Store(
-      key, entry.best_move, entry.score, entry.depth, entry.bound);
+      key, position->TransformMove(entry.best_move, symmetry), entry.score,
+      entry.depth, entry.bound);
 
   return entry.score;
 }
@@ -449,28 +694,37 @@ int ThreadedIterativeSearcher<Evaluator>::NegaMax(
 
 // Instantiation.
 
-#define INSTANTIATE_TEMPLATES_FOR(CLASS) \
-  template Move SimpleSearcher<CLASS>::SearchBestMove( \
+#define INSTANTIATE_TEMPLATES_FOR(CLASS, RULE_SET) \
+  template Move SimpleSearcher<CLASS, RULE_SET>::SearchBestMove( \
     const Position& position, Timer* timer); \
-  template Move NegaMaxSearcher<CLASS>::SearchBestMove( \
+  template Move NegaMaxSearcher<CLASS, RULE_SET>::SearchBestMove( \
       const Position& position, Timer* timer); \
-  template int NegaMaxSearcher<CLASS>::NegaMax( \
-      const Position& position, Timer* timer, \
+  template int NegaMaxSearcher<CLASS, RULE_SET>::NegaMax( \
+      Position* position, Timer* timer, int ply, \
       int depth, int alpha, int beta); \
-  template Move ThreadedIterativeSearcher<CLASS>::SearchBestMove( \
+  template Move ThreadedIterativeSearcher<CLASS, RULE_SET>::SearchBestMove( \
       const Position& position, Timer* timer); \
-  template void ThreadedIterativeSearcher<CLASS>::DoSearchBestMove( \
+  template void ThreadedIterativeSearcher<CLASS, RULE_SET>::DoSearchBestMove( \
       const Position& position, int thread_index, int num_threads, \
-      Timer* timer, Move* best_move, int* best_score, int* completed_depth); \
-  template int ThreadedIterativeSearcher<CLASS>::NegaMax( \
-      const Position& position, Timer* timer, int depth, int alpha, int beta)
+      Timer* timer, SearchStack* stack, \
+      Move* best_move, int* best_score, int* completed_depth); \
+  template int ThreadedIterativeSearcher<CLASS, RULE_SET>::NegaMax( \
+      Position* position, Timer* timer, SearchStack* stack, int ply, \
+      int depth, int alpha, int beta)
+
+#define INSTANTIATE_TEMPLATES_FOR_RULE_SET(RULE_SET) \
+  template Move RandomSearcher<RULE_SET>::SearchBestMove( \
+      const Position& position, Timer* timer); \
+  INSTANTIATE_TEMPLATES_FOR(LeafAverageEvaluator, RULE_SET); \
+  INSTANTIATE_TEMPLATES_FOR(MonteCarloEvaluator, RULE_SET); \
+  INSTANTIATE_TEMPLATES_FOR(FactorEvaluator, RULE_SET); \
+  INSTANTIATE_TEMPLATES_FOR(NoneEvaluator, RULE_SET); \
+  INSTANTIATE_TEMPLATES_FOR(AdvancedFactorEvaluator, RULE_SET); \
+  INSTANTIATE_TEMPLATES_FOR(LoopFactorEvaluator, RULE_SET)
 
-INSTANTIATE_TEMPLATES_FOR(LeafAverageEvaluator);
-INSTANTIATE_TEMPLATES_FOR(MonteCarloEvaluator);
-INSTANTIATE_TEMPLATES_FOR(FactorEvaluator);
-INSTANTIATE_TEMPLATES_FOR(NoneEvaluator);
-INSTANTIATE_TEMPLATES_FOR(AdvancedFactorEvaluator);
-INSTANTIATE_TEMPLATES_FOR(LoopFactorEvaluator);
+INSTANTIATE_TEMPLATES_FOR_RULE_SET(RULE_SET_TRAX);
+INSTANTIATE_TEMPLATES_FOR_RULE_SET(RULE_SET_TRAX_8X8);
+INSTANTIATE_TEMPLATES_FOR_RULE_SET(RULE_SET_LOOP_TRAX);
 
 namespace {
 
@@ -530,8 +784,12 @@ double AverageColor(const std::vector<double>& v) {
 
 void GenerateFactors(const Position& position,
                      std::vector<std::pair<std::string, double>> *factors) {
-  double leaf_average = LeafAverageEvaluator::Evaluate(position);
-  double factor_evaluator = FactorEvaluator::Evaluate(position);
+  // The factors are generated from the games of Trax.
+  SearchStack stack;
+  double leaf_average =
+      LeafAverageEvaluator::Evaluate<RULE_SET_TRAX>(position, &stack, 0);
+  double factor_evaluator =
+      FactorEvaluator::Evaluate<RULE_SET_TRAX>(position, &stack, 0);
   if (!position.red_to_move()) {
     leaf_average *= -1.0;
     factor_evaluator *= -1.0;
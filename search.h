@@ -4,6 +4,9 @@
 #define SEARCH_H_
 
 #include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -11,25 +14,120 @@
 #include <unordered_map>
 #include <utility>
 
+#include "./search_stack.h"
 #include "./thread.h"
 #include "./timer.h"
 #include "./trax.h"
 #include "./tt.h"
 
+// Half width of the aspiration window of the first try at each depth.
+const int kAspirationDelta = kInf / 200;
+
+// The aspiration window is not used around the scores of won or lost
+// positions, which change by the depth.
+const int kMaxAspirationScore = kInf / 2;
+
+// Score the root moves from the perspective of the side to move at the
+// root, by search(next_position, alpha, beta) which returns the score of the
+// move made on next_position. The scores are stored to scored_moves in the
+// order of root_moves, and the largest one is stored to best_score.
+//
+// The search starts with the aspiration window around previous_score if
+// aspiration is true, and widens it on a fail low or a fail high. The moves
+// after the first one are searched with a null window, and searched again
+// with the window only if they can be the best move. The scores are exact
+// for the best moves, so that the searchers can select one of them, and
+// upper bounds for the others.
+//
+// Return false if the timer timed out when check_timeout is true. The
+// scores are meaningless then.
+template <RuleSet rule_set, typename SearchFunction>
+bool SearchRootMoves(const MoveList& root_moves, int previous_score,
+                     bool aspiration, bool check_timeout, Timer* timer,
+                     Position* next_position, SearchFunction search,
+                     std::vector<ScoredMove>* scored_moves,
+                     int* best_score) {
+  int delta = kAspirationDelta;
+  int alpha = -kInf;
+  int beta = kInf;
+  if (aspiration && std::abs(previous_score) < kMaxAspirationScore) {
+    alpha = previous_score - delta;
+    beta = previous_score + delta;
+  }
+
+  while (true) {
+    scored_moves->clear();
+    *best_score = -kInf;
+
+    for (int i = 0; i < root_moves.size(); ++i) {
+      const Move move = root_moves[i];
+      const bool legal = next_position->MakeMove<rule_set>(move);
+      assert(legal);
+
+      int score = 0;
+      if (i == 0) {
+        score = search(next_position, alpha, beta);
+      } else {
+        // The moves with the same score as the best one have to be found as
+        // well, so that the null window is below the best score.
+        const int lower = std::max(alpha, *best_score - 1);
+        score = search(next_position, lower, lower + 1);
+        if (lower < score && score < beta) {
+          score = search(next_position, lower, beta);
+        }
+      }
+      next_position->UnmakeMove();
+
+      *best_score = std::max(*best_score, score);
+      scored_moves->emplace_back(score, move);
+
+      if (check_timeout && timer->CheckTimeout()) {
+        return false;
+      }
+
+      if (score >= beta && beta < kInf) {
+        // Fail high. The other moves are searched after the window is
+        // widened.
+        break;
+      }
+    }
+
+    // The bounds are computed in 64 bits, as the delta may be larger than
+    // kInf. The side at kInf is not widened any more.
+    if (*best_score <= alpha && alpha > -kInf) {
+      alpha = static_cast<int>(
+          std::max<int64_t>(int64_t{*best_score} - delta, -kInf));
+    } else if (*best_score >= beta && beta < kInf) {
+      beta = static_cast<int>(
+          std::min<int64_t>(int64_t{*best_score} + delta, kInf));
+    } else {
+      return true;
+    }
+    delta = std::min(delta, kInf / 2) * 4;
+  }
+}
+
 //
 // Searchers
 //
+// Searchers follow the rule set given as the template parameter, and pass
+// it to the evaluator. The ply of the root is 0 in their search stacks.
+//
 
 // Searcher that randomly selects any legal moves.
+template <RuleSet rule_set = RULE_SET_TRAX>
 class RandomSearcher : public Searcher {
  public:
   virtual Move SearchBestMove(const Position& position, Timer *timer);
 
   virtual std::string name() { return "RandomSearcher"; }
+
+ private:
+  RandomGenerator random_;
 };
 
 // Searcher that directly selects the best move determined by the evaluator.
-template <typename Evaluator>
+template <typename Evaluator, RuleSet rule_set = RULE_SET_TRAX>
 class SimpleSearcher : public Searcher {
  public:
   virtual Move SearchBestMove(const Position& position, Timer *timer);
@@ -37,22 +135,25 @@ class SimpleSearcher : public Searcher {
   virtual std::string name() {
     return "SimpleSearcher<" + Evaluator::name() + ">";
   }
+
+ private:
+  SearchStack stack_;
 };
 
 // Searcher that selects the best move by using the given evaluator and NegaMax
 // search with Alpha-Beta pruning.
-template <typename Evaluator>
+template <typename Evaluator, RuleSet rule_set = RULE_SET_TRAX>
 class NegaMaxSearcher : public Searcher {
  public:
   explicit NegaMaxSearcher(int max_depth,
                            bool iterative = false,
                            bool use_book = true)
-      : max_depth_(max_depth)
+      : max_depth_(std::min(max_depth, SearchStack::kMaxDepth))
       , iterative_(iterative)
       , use_book_(use_book) {
     if (use_book_) {
       std::vector<Game> games;
-      ParseCommentedGames("vendor/commented/Comment.txt", &games);
+      ParseCommentedGames("vendor/commented/Comment.txt", &games, rule_set);
       book_.Init(games);
     }
   }
@@ -74,7 +175,9 @@ class NegaMaxSearcher : public Searcher {
   }
 
  private:
-  int NegaMax(const Position& position, Timer *timer,
+  // The position is updated in place by MakeMove() / UnmakeMove(), and
+  // restored before it returns.
+  int NegaMax(Position* position, Timer *timer, int ply,
               int depth, int alpha = -kInf, int beta = kInf);
 
   int max_depth_;
@@ -83,14 +186,15 @@ class NegaMaxSearcher : public Searcher {
 
   TranspositionTable transposition_table_;
   Book book_;
+  SearchStack stack_;
 };
 
-template <typename Evaluator>
+template <typename Evaluator, RuleSet rule_set = RULE_SET_TRAX>
 class ThreadedIterativeSearcher : public ThreadedSearcher {
  public:
   ThreadedIterativeSearcher() : ThreadedSearcher() {
     std::vector<Game> games;
-    ParseCommentedGames("vendor/commented/Comment.txt", &games);
+    ParseCommentedGames("vendor/commented/Comment.txt", &games, rule_set);
     book_.Init(games);
   }
 
@@ -100,6 +204,7 @@ class ThreadedIterativeSearcher : public ThreadedSearcher {
                                 int thread_index,
                                 int num_threads,
                                 Timer* timer,
+                                SearchStack* stack,
                                 Move* best_move, int* best_score,
                                 int* completed_depth);
 
@@ -111,16 +216,25 @@ class ThreadedIterativeSearcher : public ThreadedSearcher {
   }
 
  private:
-  int NegaMax(const Position& position, Timer *timer,
+  // The position is updated in place by MakeMove() / UnmakeMove(), and
+  // restored before it returns. The search stack is that of the thread.
+  int NegaMax(Position* position, Timer *timer, SearchStack* stack, int ply,
               int depth, int alpha = -kInf, int beta = kInf);
 
   TranspositionTable transposition_table_;
   Book book_;
+
+  // Used to select book moves. The search threads have their own generators.
+  RandomGenerator random_;
 };
 
 //
 // Evaluators
 //
+// Evaluate() takes the rule set of the searcher as the template parameter,
+// and the search stack of the calling thread with the ply of the position.
+// Evaluators may use the frames from the ply on as their buffers.
+//
 
 // Evaluator that only returns zero except for finished positions.
 class NoneEvaluator {
@@ -128,7 +242,9 @@ class NoneEvaluator {
   // Evaluate the position, from the perspective of position.red_to_move().
   // or more simply, you are red inside the method if red_to_move() == true.
   // Larger value is better.
-  static int Evaluate(const Position& position) {
+  template <RuleSet rule_set>
+  static int Evaluate(const Position& position, SearchStack* stack,
+                      int ply) {
     if (position.red_to_move()) {
       // I'm red.
       // winner() > 0 if red wins.
@@ -150,7 +266,9 @@ class LeafAverageEvaluator  {
   // Evaluate the position, from the perspective of position.red_to_move().
   // or more simply, you are red inside the method if red_to_move() == true.
   // Larger value is better.
-  static int Evaluate(const Position& position) {
+  template <RuleSet rule_set>
+  static int Evaluate(const Position& position, SearchStack* stack,
+                      int ply) {
     if (position.finished()) {
       if (position.red_to_move()) {
         // I'm red.
@@ -167,9 +285,14 @@ class LeafAverageEvaluator  {
     int64_t numerator = 0;
     int64_t denominator = 0;
 
-    for (Move move : position.GenerateMoves()) {
-      Position next_position;
-      if (!position.DoMove(move, &next_position)) {
+    // Copied once and updated in place for each move.
+    Position& next_position = stack->frame(ply)->position;
+    position.CopyTo(&next_position);
+
+    MoveList& moves = stack->frame(ply)->moves;
+    position.GenerateMoves<rule_set>(&moves);
+    for (Move move : moves) {
+      if (!next_position.MakeMove<rule_set>(move)) {
         // This is illegal move.
         continue;
       }
@@ -183,6 +306,7 @@ class LeafAverageEvaluator  {
         // Flip the sign.
         score = kInf * -next_position.winner();
       }
+      next_position.UnmakeMove();
 #if 0
       if (position.Hash() == /* set board hash you want to debug here */) {
         std::cerr << "> " << score << " " << move.notation() << std::endl;
@@ -202,7 +326,9 @@ class LeafAverageEvaluator  {
 // You can change the number of time to sample by --num_monte_carlo_trial.
 class MonteCarloEvaluator {
  public:
-  static int Evaluate(const Position& initial_position) {
+  template <RuleSet rule_set>
+  static int Evaluate(const Position& initial_position, SearchStack* stack,
+                      int ply) {
     if (initial_position.finished()) {
       if (initial_position.red_to_move()) {
         // I'm red.
@@ -219,27 +345,33 @@ class MonteCarloEvaluator {
     int64_t numerator = 0;
     int64_t denominator = 0;
 
-    std::vector<Move> initial_moves = initial_position.GenerateMoves();
+    // Legal moves are filtered once here, so that every playout starts with
+    // a legal move.
+    MoveList& initial_moves = stack->frame(ply)->moves;
+    initial_position.GenerateLegalMoves<rule_set>(&initial_moves);
+
+    // Playouts are done in place on this position.
+    Position& position = stack->frame(ply)->position;
+    MoveList& moves = stack->frame(ply + 1)->moves;
+    RandomGenerator* random = stack->random();
 
     Timer timer(50);
     while (!timer.CheckTimeout()) {
-      Position position;
+      initial_position.CopyTo(&position);
 
       // First step.
-      Move initial_move = initial_moves[Random() % initial_moves.size()];
-      if (!initial_position.DoMove(initial_move, &position)) {
-        // The move is illegal.
-        continue;
-      }
+      Move initial_move = initial_moves[random->Next() % initial_moves.size()];
+      const bool legal = position.MakeMove<rule_set>(initial_move);
+      assert(legal);
 
+      // Illegal moves are rare in the playouts, so trying random moves by
+      // MakeMove() is cheaper than GenerateLegalMoves().
       while (!position.finished()) {
-        Position next_position;
-
-        std::vector<Move> moves = position.GenerateMoves();
+        position.GenerateMoves<rule_set>(&moves);
         bool legal = false;
         for (int i = 0; i < moves.size(); ++i) {
-          Move move = moves[Random() % moves.size()];
-          if (position.DoMove(move, &next_position)) {
+          Move move = moves[random->Next() % moves.size()];
+          if (position.MakeMove<rule_set>(move)) {
             // The move is legal.
             legal = true;
             break;
@@ -249,8 +381,6 @@ class MonteCarloEvaluator {
         if (!legal) {
           break;
         }
-
-        position.Swap(&next_position);
       }
 
       numerator += position.winner();
@@ -307,7 +437,9 @@ class FactorEvaluator {
   // Evaluate the position, from the perspective of position.red_to_move().
   // or more simply, you are red inside the method if red_to_move() == true.
   // Larger value is better.
-  static int Evaluate(const Position& position) {
+  template <RuleSet rule_set>
+  static int Evaluate(const Position& position, SearchStack* stack,
+                      int ply) {
     if (position.finished()) {
       if (position.red_to_move()) {
         // I'm red.
@@ -321,7 +453,7 @@ class FactorEvaluator {
       }
     }
 
-    std::vector<Line> lines;
+    std::vector<Line>& lines = stack->frame(ply)->lines;
     position.EnumerateLines(&lines);
 
     const int mate_score = CalcMateScore(position, lines);
@@ -356,7 +488,9 @@ class AdvancedFactorEvaluator {
   // Evaluate the position, from the perspective of position.red_to_move().
   // or more simply, you are red inside the method if red_to_move() == true.
   // Larger value is better.
-  static int Evaluate(const Position& position) {
+  template <RuleSet rule_set>
+  static int Evaluate(const Position& position, SearchStack* stack,
+                      int ply) {
     if (position.finished()) {
       if (position.red_to_move()) {
         // I'm red.
@@ -370,7 +504,7 @@ class AdvancedFactorEvaluator {
       }
     }
 
-    std::vector<Line> lines;
+    std::vector<Line>& lines = stack->frame(ply)->lines;
     position.EnumerateLines(&lines);
 
     const int mate_score = CalcMateScore(position, lines);
@@ -408,7 +542,9 @@ class LoopFactorEvaluator {
   // Evaluate the position, from the perspective of position.red_to_move().
   // or more simply, you are red inside the method if red_to_move() == true.
   // Larger value is better.
-  static int Evaluate(const Position& position) {
+  template <RuleSet rule_set>
+  static int Evaluate(const Position& position, SearchStack* stack,
+                      int ply) {
     if (position.finished()) {
       if (position.red_to_move()) {
         // I'm red.
@@ -422,7 +558,7 @@ class LoopFactorEvaluator {
       }
     }
 
-    std::vector<Line> lines;
+    std::vector<Line>& lines = stack->frame(ply)->lines;
     position.EnumerateLines(&lines);
 
     const int mate_score = CalcMateScore(position, lines);
@@ -0,0 +1,110 @@
+// Copyright (C) 2016 Tetsui Ohkubo.
+
+#ifndef SEARCH_STACK_H_
+#define SEARCH_STACK_H_
+
+#include <cassert>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "./trax.h"
+
+// Per-thread buffers of the search, one frame for each ply from the root.
+// The searchers and the evaluators borrow the frame of the ply instead of
+// allocating their own buffers, so that nothing is allocated per node once
+// the frames are warmed up. Frames are allocated when they are used first.
+// The stack also keeps the killer moves and the history of the thread to
+// order the moves.
+class SearchStack {
+ public:
+  struct Frame {
+    // Scratch position, e.g. for the playouts of the evaluators.
+    Position position;
+
+    // Moves generated at the ply.
+    MoveList moves;
+
+    // Scores of the moves at the root, or the orders of the moves at the
+    // other plies.
+    std::vector<ScoredMove> scored_moves;
+
+    // Moves that caused beta cutoffs at the ply, the latest first.
+    Move killers[2];
+
+    // Lines enumerated by the evaluators.
+    std::vector<Line> lines;
+  };
+
+  // Number of the frames. The constants are defined in search.cc as well,
+  // so that they can be passed by reference, e.g. to std::min().
+  static constexpr int kMaxPly = 128;
+
+  // Maximum depth of the search. The frames of the leaves and the one more
+  // frame for the evaluators are left for it.
+  static constexpr int kMaxDepth = kMaxPly - 3;
+
+  // Bound of the absolute value of the history scores.
+  static constexpr int kMaxHistory = 1 << 14;
+
+  SearchStack() : random_(), history_() {
+  }
+
+  SearchStack(SearchStack&) = delete;
+  void operator=(SearchStack) = delete;
+
+  Frame* frame(int ply) {
+    assert(0 <= ply && ply < kMaxPly);
+    if (!frames_[ply]) {
+      frames_[ply].reset(new Frame());
+    }
+    return frames_[ply].get();
+  }
+
+  // Forget the killer moves and halve the history scores, so that the
+  // history of the previous searches still helps but does not dominate.
+  void NewSearch() {
+    for (std::unique_ptr<Frame>& frame : frames_) {
+      if (frame) {
+        frame->killers[0] = Move();
+        frame->killers[1] = Move();
+      }
+    }
+    for (auto& piece_history : history_) {
+      for (auto& column : piece_history) {
+        for (int& score : column) {
+          score /= 2;
+        }
+      }
+    }
+  }
+
+  // Score of the move by the history heuristic, indexed by the piece and the
+  // location relative to the board. Larger is better.
+  int history(Move move) const {
+    assert(0 <= move.x + 1 && move.x + 1 < kBoardCapacity);
+    assert(0 <= move.y + 1 && move.y + 1 < kBoardCapacity);
+    return history_[move.piece][move.x + 1][move.y + 1];
+  }
+
+  // Add the bonus to the history score of the move. The score approaches
+  // kMaxHistory (or -kMaxHistory for a negative bonus) as it is updated.
+  void UpdateHistory(Move move, int bonus) {
+    assert(-kMaxHistory <= bonus && bonus <= kMaxHistory);
+    int& score = history_[move.piece][move.x + 1][move.y + 1];
+    score += bonus - score * std::abs(bonus) / kMaxHistory;
+  }
+
+  // Random generator of the thread.
+  RandomGenerator* random() {
+    return &random_;
+  }
+
+ private:
+  std::unique_ptr<Frame> frames_[kMaxPly];
+  RandomGenerator random_;
+
+  int history_[NUM_PIECES][kBoardCapacity][kBoardCapacity];
+};
+
+#endif  // SEARCH_STACK_H_
@@ -51,7 +51,7 @@ void SearchThread::Loop() {
     if (is_searching_ && !is_quit_) {
       // Perform actual search.
       searcher_->DoSearchBestMove(
-          *root_position_, thread_index_, num_threads_, timer_,
+          *root_position_, thread_index_, num_threads_, timer_, &stack_,
           &best_move_, &best_score_, &completed_depth_);
     }
 
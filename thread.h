@@ -8,6 +8,7 @@
 #include <condition_variable>  // NOLINT
 #include <vector>
 
+#include "./search_stack.h"
 #include "./trax.h"
 
 class ThreadedSearcher;
@@ -27,6 +28,7 @@ class SearchThread {
       , best_score_(-kInf)
       , completed_depth_(0)
       , searcher_(nullptr)
+      , stack_()
       , thread_(&SearchThread::Loop, this) {
   }
 
@@ -89,6 +91,9 @@ class SearchThread {
   int completed_depth_;
   ThreadedSearcher *searcher_;
 
+  // Owned by the thread, so that it needs no lock.
+  SearchStack stack_;
+
   std::thread thread_;
 };
 
@@ -105,6 +110,7 @@ class ThreadedSearcher : public Searcher {
                                 int thread_index,
                                 int num_threads,
                                 Timer* timer,
+                                SearchStack* stack,
                                 Move* best_move, int* best_score,
                                 int* completed_depth) = 0;
 
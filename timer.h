@@ -56,10 +56,11 @@ class Timer {
     return false;
   }
 
-  // Should be called from the bottom of the search.
-  void IncrementNodeCounter() {
+  // Should be called from the bottom of the search. Bulk counts, e.g. of
+  // perft, are added at once.
+  void IncrementNodeCounter(uint64_t count = 1) {
     // std::lock_guard<std::mutex> lock(mutex_);
-    ++node_count_;
+    node_count_ += count;
   }
 
   // Return node per second value.
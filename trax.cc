@@ -5,16 +5,16 @@
 #include <gflags/gflags.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <map>
-#include <mutex>   // NOLINT
-#include <set>
 #include <sstream>
 #include <string>
 #include <thread>  // NOLINT
+#include <tuple>
 #include <utility>
 
 #include "./timer.h"
@@ -28,53 +28,152 @@ DEFINE_bool(enable_strict_timer, true,
 
 DEFINE_bool(trax8x8, false, "Run as 8x8 Trax.");
 
+DEFINE_bool(loop_trax, false, "Run as Loop Trax.");
+
 DEFINE_string(player_id, "PE",
             "Contest issued player ID.");
 
 DEFINE_int32(thinking_time_ms, 1000,
             "Thinking time in milliseconds.");
 
+DEFINE_int32(seed, 0,
+             "Random seed. Each searcher and each search thread derives its "
+             "own random stream from it.");
+
+
+namespace {
+
+// SplitMix64. Used to expand a seed to the state of other generators.
+constexpr uint64_t SplitMix64(uint64_t* state) {
+  *state += 0x9e3779b97f4a7c15ULL;
+  uint64_t z = *state;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// Stream of the next RandomGenerator constructed without a seed.
+std::atomic<uint64_t> g_next_random_stream(0);
+
+}  // namespace
+
+RandomGenerator::RandomGenerator() {
+  Seed(FLAGS_seed, g_next_random_stream++);
+}
+
+void RandomGenerator::Seed(uint64_t seed, uint64_t stream) {
+  // The stream is scrambled before mixed into the seed, as SplitMix64
+  // sequences starting from nearby states overlap.
+  uint64_t state = stream;
+  state = SplitMix64(&state) ^ seed;
+  for (int i = 0; i < 4; i += 2) {
+    const uint64_t z = SplitMix64(&state);
+    state_[i] = static_cast<uint32_t>(z);
+    state_[i + 1] = static_cast<uint32_t>(z >> 32);
+  }
+}
+
+namespace {
+
+// Per-thread free list of board buffers. Buffers are kept until the thread
+// exits, so that Position::DoMove() stops allocating once the search is
+// warmed up. The pool does not need a lock since it is thread local.
+class BoardBufferPool {
+ public:
+  BoardBufferPool() : free_list_(nullptr) {
+  }
+
+  ~BoardBufferPool() {
+    while (free_list_ != nullptr) {
+      BoardBuffer* next = free_list_->next_free;
+      delete free_list_;
+      free_list_ = next;
+    }
+  }
+
+  BoardBuffer* Acquire() {
+    if (free_list_ == nullptr) {
+      return new BoardBuffer();
+    }
+    BoardBuffer* buffer = free_list_;
+    free_list_ = buffer->next_free;
+    return buffer;
+  }
 
-uint32_t Random() {
-  static uint32_t x = 123456789;
-  static uint32_t y = 362436069;
-  static uint32_t z = 521288629;
-  static uint32_t w = 88675123;
-  static std::mutex mutex;
-  uint32_t t;
-  std::lock_guard<std::mutex> lock(mutex);
+  void Release(BoardBuffer* buffer) {
+    buffer->next_free = free_list_;
+    free_list_ = buffer;
+  }
+
+ private:
+  BoardBuffer* free_list_;
+};
+
+thread_local BoardBufferPool g_board_buffer_pool;
+
+thread_local LineScratch g_line_scratch;
 
-  t = x ^ (x << 11);
-  x = y; y = z; z = w;
-  return w = (w ^ (w >> 19)) ^ (t ^ (t >> 8));
+thread_local ForcedPlayScratch g_forced_play_scratch;
+
+// Start a new stamp of the scratch, so that the cells queued or traced so
+// far are considered unvisited.
+void AdvanceStamp(ForcedPlayScratch* scratch) {
+  ++scratch->stamp;
+  if (scratch->stamp == 0) {
+    // Stamps wrapped around. Invalidate everything once.
+    std::memset(scratch->queued_stamps, 0, sizeof(scratch->queued_stamps));
+    std::memset(scratch->traced_stamps, 0, sizeof(scratch->traced_stamps));
+    scratch->stamp = 1;
+  }
+}
+
+}  // namespace
+
+BoardBuffer* AcquireBoardBuffer() {
+  return g_board_buffer_pool.Acquire();
+}
+
+void ReleaseBoardBuffer(BoardBuffer* buffer) {
+  if (buffer != nullptr) {
+    g_board_buffer_pool.Release(buffer);
+  }
+}
+
+// The lookup tables below are generated at compile time, so that they are
+// ready before main() and no initialization is needed to use Position.
+
+// Fixed size array that can be filled in constexpr functions, since
+// std::array::operator[] is not constexpr until C++17.
+template <typename T, int N>
+struct LookupTable {
+  constexpr const T& operator[](int i) const { return values[i]; }
+  constexpr T& operator[](int i) { return values[i]; }
+
+  T values[N];
+};
+
+// Return 1 if the edge of the piece in the direction is red.
+constexpr int RedEdge(int piece, int direction) {
+  return (kPieceRedEdges[piece] >> direction) & 1;
 }
 
 using NeighborKey = uint32_t;
 
 // Encode neighboring pieces into key.
-NeighborKey EncodeNeighborKey(int right, int top, int left, int bottom) {
+constexpr NeighborKey EncodeNeighborKey(int right, int top, int left,
+                                        int bottom) {
   return static_cast<NeighborKey>(
       right + (top << 3) + (left << 6) + (bottom << 9));
 }
 
-// Table of possible piece kinds for the certain neighboring piece combination.
-// Using this gives significant performance improvement on
-// Position::GetPossiblePieces().
-PieceSet g_possible_pieces_table[1 << 12];
-
-// Should be called before Position::GetPossiblePieces().
-void GeneratePossiblePiecesTable() {
-  std::fill(g_possible_pieces_table,
-            g_possible_pieces_table +
-            sizeof(g_possible_pieces_table) /
-            sizeof(g_possible_pieces_table[0]),
-            PieceSet());
+constexpr LookupTable<PieceSet, 1 << 12> GeneratePossiblePiecesTable() {
+  LookupTable<PieceSet, 1 << 12> table{};
 
   for (int i_right = 0; i_right < NUM_PIECES; ++i_right) {
     for (int j_top = 0; j_top < NUM_PIECES; ++j_top) {
       for (int k_left = 0; k_left < NUM_PIECES; ++k_left) {
         for (int l_bottom = 0; l_bottom < NUM_PIECES; ++l_bottom) {
-          PieceSet pieces;
+          PieceSet pieces = 0;
 
           if (i_right == PIECE_EMPTY &&
               j_top == PIECE_EMPTY &&
@@ -82,61 +181,141 @@ void GeneratePossiblePiecesTable() {
               l_bottom == PIECE_EMPTY) {
             // If all the neighboring pieces are empty then empty piece is
             // the only legal piece.
-            pieces.set(PIECE_EMPTY);
+            pieces = 1 << PIECE_EMPTY;
           } else {
-            const char *neighbors[4] = {
-              kPieceColors[i_right],
-              kPieceColors[j_top],
-              kPieceColors[k_left],
-              kPieceColors[l_bottom]
-            };
+            const int neighbors[4] = {i_right, j_top, k_left, l_bottom};
 
             // Exclude empty piece for this loop.
-            for (int m_candidate = 1; m_candidate< NUM_PIECES; ++m_candidate) {
-              const char *candidate = kPieceColors[m_candidate];
-
+            for (int m_candidate = 1; m_candidate < NUM_PIECES; ++m_candidate) {
               bool valid = true;
               for (int n = 0; n < 4; ++n) {
                 // If the neighboring cell isn't empty,
                 // and the color of the shared edges are different,
                 // then the candidate is invalid piece placement.
-                if (neighbors[n][0] != '_' &&
-                    candidate[n] != neighbors[n][(n + 2) & 3]) {
+                if (neighbors[n] != PIECE_EMPTY &&
+                    RedEdge(m_candidate, n) !=
+                    RedEdge(neighbors[n], (n + 2) & 3)) {
                   valid = false;
                   break;
                 }
               }
 
               if (valid) {
-                pieces.set(m_candidate);
+                pieces |= 1 << m_candidate;
               }
             }
 
             // If it is possible to place at least one kind of non-empty pieces
             // then it would also legal to remain empty.
             // Otherwise, the placement is illegal at all.
-            if (pieces.count() > 0) {
-              pieces.set(PIECE_EMPTY);
+            if (pieces != 0) {
+              pieces |= 1 << PIECE_EMPTY;
             }
           }
 
-          if (pieces.count() > 0) {
-            g_possible_pieces_table[
-              EncodeNeighborKey(i_right, j_top, k_left, l_bottom)] = pieces;
+          table[EncodeNeighborKey(i_right, j_top, k_left, l_bottom)] = pieces;
+        }
+      }
+    }
+  }
+  return table;
+}
+
+constexpr LookupTable<PieceSet, 1 << 8> GenerateEdgePossiblePiecesTable() {
+  LookupTable<PieceSet, 1 << 8> table{};
+
+  for (int i_key = 0; i_key < (1 << 8); ++i_key) {
+    PieceSet pieces = 0;
+
+    bool has_neighbor = false;
+    bool valid_key = true;
+    for (int j = 0; j < 4; ++j) {
+      const bool present = (i_key >> (2 * j)) & 1;
+      const bool red = (i_key >> (2 * j + 1)) & 1;
+      has_neighbor |= present;
+      // Red edge without a piece never happens.
+      valid_key &= present || !red;
+    }
+
+    if (!valid_key) {
+      continue;
+    }
+
+    if (!has_neighbor) {
+      // Only empty piece is legal, like the table above.
+      pieces = 1 << PIECE_EMPTY;
+    } else {
+      for (int m_candidate = 1; m_candidate < NUM_PIECES; ++m_candidate) {
+        bool valid = true;
+        for (int n = 0; n < 4; ++n) {
+          const bool present = (i_key >> (2 * n)) & 1;
+          const int red = (i_key >> (2 * n + 1)) & 1;
+          if (present && RedEdge(m_candidate, n) != red) {
+            valid = false;
+            break;
           }
         }
+
+        if (valid) {
+          pieces |= 1 << m_candidate;
+        }
+      }
+
+      if (pieces != 0) {
+        pieces |= 1 << PIECE_EMPTY;
       }
     }
+
+    table[i_key] = pieces;
   }
+  return table;
 }
 
-// Table of track directions that come into pieces.
-// Although using this makes code simpler, the performance improvement on
-// Position::TraceVictoryLineOrLoop() is slighter.
-int g_track_direction_table[NUM_PIECES][4];
+constexpr LookupTable<LookupTable<PieceSet, 2>, 4>
+GenerateEdgeCompatiblePiecesTable() {
+  LookupTable<LookupTable<PieceSet, 2>, 4> table{};
+
+  for (int i = 0; i < 4; ++i) {
+    for (int j_red = 0; j_red < 2; ++j_red) {
+      PieceSet pieces = 1 << PIECE_EMPTY;
+      for (int k = 1; k < NUM_PIECES; ++k) {
+        if (RedEdge(k, i) == j_red) {
+          pieces |= 1 << k;
+        }
+      }
+      table[i][j_red] = pieces;
+    }
+  }
+  return table;
+}
+
+// Table of possible piece kinds for the certain neighboring piece combination.
+// Position uses kEdgePossiblePiecesTable below instead, and this one is kept
+// to cross-check it in the tests through GetPossiblePiecesOfNeighbors().
+constexpr LookupTable<PieceSet, 1 << 12> kPossiblePiecesTable =
+    GeneratePossiblePiecesTable();
+
+// Same as kPossiblePiecesTable, but indexed by EdgeKey. Position uses this
+// one since EdgeKey is directly computed from the bitplanes.
+// Using this gives significant performance improvement on
+// Position::GetPossiblePieces().
+constexpr LookupTable<PieceSet, 1 << 8> kEdgePossiblePiecesTable =
+    GenerateEdgePossiblePiecesTable();
+
+// Pieces (and the empty piece) that are possible with an edge of the color
+// (red if [1]) in the direction.
+constexpr LookupTable<LookupTable<PieceSet, 2>, 4>
+    kEdgeCompatiblePiecesTable = GenerateEdgeCompatiblePiecesTable();
+
+PieceSet GetPossiblePiecesOfNeighbors(int right, int top, int left,
+                                      int bottom) {
+  return kPossiblePiecesTable[EncodeNeighborKey(right, top, left, bottom)];
+}
+
+constexpr LookupTable<LookupTable<uint8_t, 4>, NUM_PIECES>
+GenerateTrackDirectionTable() {
+  LookupTable<LookupTable<uint8_t, 4>, NUM_PIECES> table{};
 
-// Should be called before Position::TraceVictoryLineOrLoop().
-void GenerateTrackDirectionTable() {
   // Skip empty piece.
   for (int i = 1; i < NUM_PIECES; ++i) {
     // Loop for direction that the track come from.
@@ -144,71 +323,254 @@ void GenerateTrackDirectionTable() {
       // Find the direction that the track goes to.
       for (int k = 0; k < 4; ++k) {
         // Two edges have the same color.
-        if (j != k && kPieceColors[i][j] == kPieceColors[i][k]) {
-          g_track_direction_table[i][j] = k;
+        if (j != k && RedEdge(i, j) == RedEdge(i, k)) {
+          table[i][j] = k;
         }
       }
     }
   }
+  return table;
 }
 
-bool g_forced_play_table[1 << 12];
-
-// Should be called before Position::FillForcedPieces().
-void GenerateForcedPlayTable() {
-  std::fill(g_forced_play_table,
-            g_forced_play_table +
-            sizeof(g_forced_play_table) /
-            sizeof(g_forced_play_table[0]),
-            false);
+// Table of track directions that come into pieces.
+// Although using this makes code simpler, the performance improvement on
+// Position::TraceVictoryLineOrLoop() is slighter.
+constexpr LookupTable<LookupTable<uint8_t, 4>, NUM_PIECES>
+    kTrackDirectionTable = GenerateTrackDirectionTable();
 
-  for (int i_right = 0; i_right < NUM_PIECES; ++i_right) {
-    for (int j_top = 0; j_top < NUM_PIECES; ++j_top) {
-      for (int k_left = 0; k_left < NUM_PIECES; ++k_left) {
-        for (int l_bottom = 0; l_bottom < NUM_PIECES; ++l_bottom) {
-          NeighborKey key = EncodeNeighborKey(
-              i_right, j_top, k_left, l_bottom);
-          PieceSet pieces = g_possible_pieces_table[key];
-          // No possible piece including empty one for the location.
-          // The position is invalid.
-          if (pieces.count() == 0) {
-            continue;
-          }
+constexpr LookupTable<bool, 1 << NUM_PIECES> GenerateForcedPlayTable() {
+  LookupTable<bool, 1 << NUM_PIECES> table{};
 
-          // Exclude empty piece.
-          pieces.reset(PIECE_EMPTY);
+  for (int i_set = 0; i_set < (1 << NUM_PIECES); ++i_set) {
+    // No possible piece including empty one for the location.
+    // The position is invalid.
+    if (!((i_set >> PIECE_EMPTY) & 1)) {
+      continue;
+    }
 
-          if (pieces.count() != 1) {
-            // If more than one piece kind is possible, forced play
-            // does not happen.
-            continue;
-          }
+    // If more than one piece kind is possible, forced play does not happen.
+    // Only one piece kind is possible if and only if two edges of the same
+    // color face the cell, since every piece has two red and two white
+    // edges.
+    table[i_set] = __builtin_popcount(i_set & ~(1 << PIECE_EMPTY)) == 1;
+  }
+  return table;
+}
 
-          int red_count = 0;
-          int white_count = 0;
+// Table of possible piece sets that trigger forced play, indexed by PieceSet.
+constexpr LookupTable<bool, 1 << NUM_PIECES> kForcedPlayTable =
+    GenerateForcedPlayTable();
 
-          int neighbors[4] = {i_right, j_top, k_left, l_bottom};
-          for (int m = 0; m < 4; ++m) {
-            const int neighbor = neighbors[m];
-            if (neighbor == PIECE_EMPTY) {
-              continue;
-            }
+constexpr LookupTable<LookupTable<Piece, NUM_PIECES>, kNumSymmetries>
+GenerateTransformedPieceTable(bool inverse) {
+  LookupTable<LookupTable<Piece, NUM_PIECES>, kNumSymmetries> table{};
 
-            if (kPieceColors[neighbor][(m + 2) & 3] == 'R') {
-              ++red_count;
-            } else if (kPieceColors[neighbor][(m + 2) & 3] == 'W') {
-              ++white_count;
-            }
+  for (int i = 0; i < kNumSymmetries; ++i) {
+    for (int j = 0; j < NUM_PIECES; ++j) {
+      uint8_t red_edges = 0;
+      for (int k = 0; k < 4; ++k) {
+        if (!RedEdge(j, k)) {
+          continue;
+        }
+        int dx = kDx[k], dy = kDy[k];
+        if (i & kSymmetryTranspose) {
+          const int t = dx;
+          dx = dy;
+          dy = t;
+        }
+        if (i & kSymmetryFlipX) {
+          dx = -dx;
+        }
+        if (i & kSymmetryFlipY) {
+          dy = -dy;
+        }
+        for (int l = 0; l < 4; ++l) {
+          if (kDx[l] == dx && kDy[l] == dy) {
+            red_edges |= 1 << l;
           }
-          if (red_count >= 2 || white_count >= 2) {
-            g_forced_play_table[key] = true;
+        }
+      }
+      if (j != PIECE_EMPTY && (i & kSymmetrySwapColors)) {
+        red_edges ^= 0xf;
+      }
+      for (int l = 0; l < NUM_PIECES; ++l) {
+        if (kPieceRedEdges[l] == red_edges) {
+          if (inverse) {
+            table[i][l] = static_cast<Piece>(j);
+          } else {
+            table[i][j] = static_cast<Piece>(l);
           }
         }
       }
     }
   }
+  return table;
+}
+
+// Piece transformed by the symmetry, indexed by [symmetry][piece].
+constexpr LookupTable<LookupTable<Piece, NUM_PIECES>, kNumSymmetries>
+    kTransformedPieceTable = GenerateTransformedPieceTable(false);
+
+// Inverse of the above.
+constexpr LookupTable<LookupTable<Piece, NUM_PIECES>, kNumSymmetries>
+    kInverseTransformedPieceTable = GenerateTransformedPieceTable(true);
+
+// The key of the piece at (x, y) is
+//
+//   piece_key[piece] * kZobristShiftX^x * kZobristShiftY^y
+//
+// where (x, y) is relative to the top left corner of the board, and the key
+// of the position is the sum of them. Moving every piece by one to the right
+// multiplies the sum by kZobristShiftX, so the key is updated in O(1) when
+// the board grows to the left, instead of being computed again.
+// Keys are summed instead of xor-ed for that reason.
+//
+// The key of a piece with swapped colors is the negation of the original
+// one, so that the key of the board with swapped colors is the negation of
+// the sum.
+constexpr PositionHash kZobristShiftX = 0xd6e8feb86659fd93ULL;
+constexpr PositionHash kZobristShiftY = 0xa0761d6478bd642fULL;
+
+constexpr LookupTable<LookupTable<PositionHash, NUM_PIECES>, kMaxBoardSize>
+GenerateZobristXTable() {
+  LookupTable<LookupTable<PositionHash, NUM_PIECES>, kMaxBoardSize> table{};
+
+  // SplitMix64 with a fixed seed, so that the keys are same among runs
+  // regardless of --seed.
+  uint64_t state = 0;
+  PositionHash piece_keys[NUM_PIECES] = {};
+  for (int i = 0; i < NUM_PIECES; ++i) {
+    piece_keys[i] = SplitMix64(&state);
+  }
+  // Empty cells do not contribute to the key.
+  piece_keys[PIECE_EMPTY] = 0;
+
+  // Negate the keys of the pieces with swapped colors.
+  for (int i = 0; i < NUM_PIECES; ++i) {
+    const Piece swapped = kTransformedPieceTable[kSymmetrySwapColors][i];
+    if (swapped < i) {
+      piece_keys[i] = -piece_keys[swapped];
+    }
+  }
+
+  PositionHash power_x = 1;
+  for (int i = 0; i < kMaxBoardSize; ++i) {
+    for (int j = 0; j < NUM_PIECES; ++j) {
+      table[i][j] = piece_keys[j] * power_x;
+    }
+    power_x *= kZobristShiftX;
+  }
+  return table;
+}
+
+constexpr LookupTable<PositionHash, kMaxBoardSize> GenerateZobristYTable() {
+  LookupTable<PositionHash, kMaxBoardSize> table{};
+
+  PositionHash power_y = 1;
+  for (int i = 0; i < kMaxBoardSize; ++i) {
+    table[i] = power_y;
+    power_y *= kZobristShiftY;
+  }
+  return table;
 }
 
+// piece_key[piece] * kZobristShiftX^x, indexed by [x][piece].
+constexpr LookupTable<LookupTable<PositionHash, NUM_PIECES>, kMaxBoardSize>
+    kZobristXTable = GenerateZobristXTable();
+
+// kZobristShiftY^y.
+constexpr LookupTable<PositionHash, kMaxBoardSize> kZobristYTable =
+    GenerateZobristYTable();
+
+
+namespace {
+
+// Transform the coordinates on the board of max_x by max_y by the symmetry.
+// The coordinates just outside of the board are also mapped to the ones
+// outside of the transformed board.
+inline void TransformCoordinates(int symmetry, int max_x, int max_y,
+                                 int* x, int* y) {
+  if (symmetry & kSymmetryTranspose) {
+    std::swap(*x, *y);
+    std::swap(max_x, max_y);
+  }
+  if (symmetry & kSymmetryFlipX) {
+    *x = max_x - 1 - *x;
+  }
+  if (symmetry & kSymmetryFlipY) {
+    *y = max_y - 1 - *y;
+  }
+}
+
+// Update the keys of the transformed boards when the board grows.
+// grow_x is -1 if the board grows to the left, 1 if it grows to the right,
+// and 0 otherwise. Same for grow_y.
+inline void GrowSymmetricKeys(int grow_x, int grow_y, PositionHash* keys) {
+  for (int i = 0; i < kNumBoardSymmetries; ++i) {
+    int dx = grow_x, dy = grow_y;
+    if (i & kSymmetryTranspose) {
+      std::swap(dx, dy);
+    }
+    if (i & kSymmetryFlipX) {
+      dx = -dx;
+    }
+    if (i & kSymmetryFlipY) {
+      dy = -dy;
+    }
+    // The pieces move only when the transformed board grows to the left or
+    // top.
+    if (dx < 0) {
+      keys[i] *= kZobristShiftX;
+    }
+    if (dy < 0) {
+      keys[i] *= kZobristShiftY;
+    }
+  }
+}
+
+// Copy num_rows rows of the column from begin_row, wrapping around the end of
+// the column.
+template <typename T>
+void CopyRows(const T* from, T* to, int begin_row, int num_rows) {
+  assert(0 <= begin_row && begin_row < kBoardCapacity);
+  assert(0 <= num_rows && num_rows <= kBoardCapacity);
+  const int num_first_rows = std::min(num_rows, kBoardCapacity - begin_row);
+  std::memcpy(to + begin_row, from + begin_row, num_first_rows * sizeof(T));
+  std::memcpy(to, from, (num_rows - num_first_rows) * sizeof(T));
+}
+
+// Empty the cells and the bitplanes of the column of the board.
+void ClearColumn(BoardBuffer* board, int column) {
+  std::memset(board->cells + column * kBoardCapacity, PIECE_EMPTY,
+              kBoardCapacity);
+  board->occupied[column] = 0;
+  for (int i = 0; i < 4; ++i) {
+    board->red_edges[i][column] = 0;
+  }
+  board->frontier[column] = 0;
+}
+
+// Encode the line end of the piece at (x + dx, y + dy) in the direction
+// (kDx[direction], kDy[direction]) for BoardBuffer::line_ends of (x, y).
+uint16_t EncodeLineEnd(int dx, int dy, int direction) {
+  assert(-64 < dx && dx < 64 && -64 < dy && dy < 64);
+  return static_cast<uint16_t>((dx + 64) | ((dy + 64) << 7) |
+                               (direction << 14));
+}
+
+int LineEndDx(uint16_t line_end) {
+  return (line_end & 0x7f) - 64;
+}
+
+int LineEndDy(uint16_t line_end) {
+  return ((line_end >> 7) & 0x7f) - 64;
+}
+
+int LineEndDirection(uint16_t line_end) {
+  return line_end >> 14;
+}
+
+}  // namespace
 
 Move::Move(const std::string& trax_notation,
            const Position& previous_position)
@@ -278,11 +640,11 @@ bool Move::Parse(const std::string& trax_notation,
     PieceSet candidates = previous_position.GetPossiblePieces(x, y);
 
     // Exclude EMPTY piece for added piece candidates.
-    candidates.reset(PIECE_EMPTY);
+    candidates &= ~(1 << PIECE_EMPTY);
 
     piece = PIECE_EMPTY;
     for (int i = 0; i < NUM_PIECES; ++i) {
-      if (kPieceNotations[i] == *it && candidates.test(i)) {
+      if (kPieceNotations[i] == *it && ((candidates >> i) & 1)) {
         piece = static_cast<Piece>(i);
         break;
       }
@@ -305,230 +667,1106 @@ std::string Move::notation() const {
   if (x == -1) {
     trax_notation << '@';
   } else {
-    // This way of encoding is called Bijective base-26.
-    // https://github.com/alexfeseto/hexavigesimal
-    // Specified in: http://fpt.massey.ac.nz/design_competition_rules.asp
-    std::string columns;
-    int num = x + 1;
-    while (num > 0) {
-      --num;
-      columns += static_cast<char>(num % ('Z' - 'A' + 1) + 'A');
-      num /= 'Z' - 'A' + 1;
+    // This way of encoding is called Bijective base-26.
+    // https://github.com/alexfeseto/hexavigesimal
+    // Specified in: http://fpt.massey.ac.nz/design_competition_rules.asp
+    std::string columns;
+    int num = x + 1;
+    while (num > 0) {
+      --num;
+      columns += static_cast<char>(num % ('Z' - 'A' + 1) + 'A');
+      num /= 'Z' - 'A' + 1;
+    }
+    std::reverse(columns.begin(), columns.end());
+    trax_notation << columns;
+  }
+
+  trax_notation << y + 1;
+  trax_notation << kPieceNotations[piece];
+  return trax_notation.str();
+}
+
+RuleSet GetRuleSet() {
+  if (FLAGS_trax8x8) {
+    return RULE_SET_TRAX_8X8;
+  }
+  if (FLAGS_loop_trax) {
+    return RULE_SET_LOOP_TRAX;
+  }
+  return RULE_SET_TRAX;
+}
+
+std::vector<Move> Position::GenerateMoves() const {
+  MoveList moves;
+  GenerateMoves(&moves);
+  return std::vector<Move>(moves.begin(), moves.end());
+}
+
+void Position::GenerateMoves(MoveList* moves) const {
+  switch (GetRuleSet()) {
+    case RULE_SET_TRAX_8X8:
+      return GenerateMoves<RULE_SET_TRAX_8X8>(moves);
+    case RULE_SET_LOOP_TRAX:
+      return GenerateMoves<RULE_SET_LOOP_TRAX>(moves);
+    default:
+      return GenerateMoves<RULE_SET_TRAX>(moves);
+  }
+}
+
+void Position::GenerateLegalMoves(MoveList* moves) const {
+  switch (GetRuleSet()) {
+    case RULE_SET_TRAX_8X8:
+      return GenerateLegalMoves<RULE_SET_TRAX_8X8>(moves);
+    case RULE_SET_LOOP_TRAX:
+      return GenerateLegalMoves<RULE_SET_LOOP_TRAX>(moves);
+    default:
+      return GenerateLegalMoves<RULE_SET_TRAX>(moves);
+  }
+}
+
+void Position::GenerateUniqueMoves(MoveList* moves) const {
+  switch (GetRuleSet()) {
+    case RULE_SET_TRAX_8X8:
+      return GenerateUniqueMoves<RULE_SET_TRAX_8X8>(moves);
+    case RULE_SET_LOOP_TRAX:
+      return GenerateUniqueMoves<RULE_SET_LOOP_TRAX>(moves);
+    default:
+      return GenerateUniqueMoves<RULE_SET_TRAX>(moves);
+  }
+}
+
+bool Position::IsPossibleMove(Move move) const {
+  switch (GetRuleSet()) {
+    case RULE_SET_TRAX_8X8:
+      return IsPossibleMove<RULE_SET_TRAX_8X8>(move);
+    case RULE_SET_LOOP_TRAX:
+      return IsPossibleMove<RULE_SET_LOOP_TRAX>(move);
+    default:
+      return IsPossibleMove<RULE_SET_TRAX>(move);
+  }
+}
+
+bool Position::IsLegalMove(Move move, PositionHash* hash) const {
+  switch (GetRuleSet()) {
+    case RULE_SET_TRAX_8X8:
+      // Invalid move for 8x8 Trax.
+      return !IsOutOfLimitedBoard(move) &&
+          IsLegalMove<RULE_SET_TRAX_8X8>(move, hash);
+    case RULE_SET_LOOP_TRAX:
+      return IsLegalMove<RULE_SET_LOOP_TRAX>(move, hash);
+    default:
+      return IsLegalMove<RULE_SET_TRAX>(move, hash);
+  }
+}
+
+bool Position::DoMove(Move move, Position *next_position) const {
+  switch (GetRuleSet()) {
+    case RULE_SET_TRAX_8X8:
+      // Invalid move for 8x8 Trax.
+      return !IsOutOfLimitedBoard(move) &&
+          DoMove<RULE_SET_TRAX_8X8>(move, next_position);
+    case RULE_SET_LOOP_TRAX:
+      return DoMove<RULE_SET_LOOP_TRAX>(move, next_position);
+    default:
+      return DoMove<RULE_SET_TRAX>(move, next_position);
+  }
+}
+
+bool Position::MakeMove(Move move) {
+  switch (GetRuleSet()) {
+    case RULE_SET_TRAX_8X8:
+      // Invalid move for 8x8 Trax.
+      return !IsOutOfLimitedBoard(move) &&
+          MakeMove<RULE_SET_TRAX_8X8>(move);
+    case RULE_SET_LOOP_TRAX:
+      return MakeMove<RULE_SET_LOOP_TRAX>(move);
+    default:
+      return MakeMove<RULE_SET_TRAX>(move);
+  }
+}
+
+template <RuleSet rule_set>
+void Position::GenerateMoves(MoveList* moves) const {
+  moves->clear();
+
+  if (finished()) {
+    // This is a finished game.
+    return;
+  }
+
+  // If this is the first step then they are only valid moves.
+  // They are "@0/" and "@0+".
+  if (max_x_ == 0 && max_y_ == 0) {
+    moves->emplace_back(-1, -1, PIECE_RWWR);
+    moves->emplace_back(-1, -1, PIECE_RWRW);
+    return;
+  }
+
+  // Cells in [-1, max_x] x [-1, max_y] may have moves.
+  int begin_x = -1;
+  int end_x = max_x_ + 1;
+  uint64_t rows = ((1ULL << (max_y_ + 2)) - 1) << 1;
+
+  if (RuleSetTraits<rule_set>::kLimitedBoard) {
+    // Moves outside 8x8 are invalid for 8x8 Trax.
+    if (max_x_ >= 8) {
+      begin_x = 0;
+      end_x = max_x_;
+    }
+    if (max_y_ >= 8) {
+      rows = ((1ULL << max_y_) - 1) << 2;
+    }
+  }
+
+  for (int i_x = begin_x; i_x < end_x; ++i_x) {
+    const PieceSet* possible_pieces = board_->possible_pieces[column(i_x)];
+
+    // The frontier and the possible pieces are maintained by PutPiece(),
+    // so no other cells have to be looked at.
+    for (uint64_t frontier = column_bits(board_->frontier, i_x) & rows;
+         frontier != 0; frontier &= frontier - 1) {
+      const int y = __builtin_ctzll(frontier) - 2;
+
+      // Exclude EMPTY piece for added piece candidates.
+      for (PieceSet pieces = possible_pieces[row(y)] & ~(1 << PIECE_EMPTY);
+           pieces != 0; pieces &= pieces - 1) {
+        moves->emplace_back(i_x, y, static_cast<Piece>(__builtin_ctz(pieces)));
+      }
+    }
+  }
+}
+
+template <RuleSet rule_set>
+bool Position::IsPossibleMove(Move move) const {
+  if (finished() || move.piece == PIECE_EMPTY) {
+    return false;
+  }
+
+  // Same as GenerateMoves().
+  if (max_x_ == 0 && max_y_ == 0) {
+    return move.x == -1 && move.y == -1 &&
+        (move.piece == PIECE_RWWR || move.piece == PIECE_RWRW);
+  }
+
+  if (move.x < -1 || move.x > max_x_ || move.y < -1 || move.y > max_y_) {
+    return false;
+  }
+  if (RuleSetTraits<rule_set>::kLimitedBoard && IsOutOfLimitedBoard(move)) {
+    return false;
+  }
+  if (((column_bits(board_->frontier, move.x) >> (move.y + 2)) & 1) == 0) {
+    return false;
+  }
+  return (board_->possible_pieces[column(move.x)][row(move.y)] &
+          (1 << move.piece)) != 0;
+}
+
+template <RuleSet rule_set>
+void Position::GenerateLegalMoves(MoveList* moves) const {
+  GenerateMoves<rule_set>(moves);
+
+  int num_legal_moves = 0;
+  for (Move move : *moves) {
+    if (IsLegalMove<rule_set>(move)) {
+      (*moves)[num_legal_moves++] = move;
+    }
+  }
+  moves->resize(num_legal_moves);
+}
+
+template <RuleSet rule_set>
+void Position::GenerateUniqueMoves(MoveList* moves) const {
+  GenerateMoves<rule_set>(moves);
+
+  // Open addressing table of the hashes of the resulting positions. It is
+  // cleared by incrementing the stamp.
+  static const int kTableSize = 1 << 15;
+  static_assert(kTableSize >= 2 * kMaxMoves, "table is too small");
+  struct HashTable {
+    PositionHash hashes[kTableSize];
+    uint32_t stamps[kTableSize];
+    uint32_t stamp = 0;
+  };
+  static thread_local HashTable table;
+  if (++table.stamp == 0) {
+    std::fill(table.stamps, table.stamps + kTableSize, 0);
+    table.stamp = 1;
+  }
+
+  int num_unique_moves = 0;
+  for (Move move : *moves) {
+    PositionHash hash;
+    if (!IsLegalMove<rule_set>(move, &hash)) {
+      continue;
+    }
+    int i = hash & (kTableSize - 1);
+    while (table.stamps[i] == table.stamp && table.hashes[i] != hash) {
+      i = (i + 1) & (kTableSize - 1);
+    }
+    if (table.stamps[i] == table.stamp) {
+      // Same as the position of the previous move.
+      continue;
+    }
+    table.stamps[i] = table.stamp;
+    table.hashes[i] = hash;
+    (*moves)[num_unique_moves++] = move;
+  }
+  moves->resize(num_unique_moves);
+}
+
+template <RuleSet rule_set>
+bool Position::IsLegalMove(Move move, PositionHash* hash) const {
+  assert(move.piece != PIECE_EMPTY);
+
+  // Moves out of the board of 8x8 Trax are rejected by the callers.
+  assert(!RuleSetTraits<rule_set>::kLimitedBoard ||
+         !IsOutOfLimitedBoard(move));
+
+  if (finished()) {
+    // Every move after the game finished is illegal.
+    return false;
+  }
+
+  // Region of the board after the move, in the coordinates of this board.
+  // Forced plays only happen inside it.
+  const int begin_x = std::min(0, static_cast<int>(move.x));
+  const int end_x = std::max(max_x_, move.x + 1);
+  const int begin_y = std::min(0, static_cast<int>(move.y));
+  const int end_y = std::max(max_y_, move.y + 1);
+
+  if (end_x - begin_x > kMaxBoardSize || end_y - begin_y > kMaxBoardSize) {
+    // The board buffer cannot hold the position.
+    return false;
+  }
+
+  if (board_ == nullptr) {
+    // The first move.
+    if (hash != nullptr) {
+      *hash = FinalizeKey(kZobristXTable[0][move.piece] *
+                          kZobristYTable[0], !red_to_move_);
+    }
+    return true;
+  }
+
+  assert(at(move.x, move.y) == PIECE_EMPTY);
+
+  // Pieces placed by the simulation, i.e. the move and the forced plays.
+  // They are few, so they are linearly searched.
+  static const int kMaxSimulatedPieces = 64;
+  int8_t placed_x[kMaxSimulatedPieces];
+  int8_t placed_y[kMaxSimulatedPieces];
+  Piece placed_pieces[kMaxSimulatedPieces];
+  int num_placed = 0;
+
+  std::pair<int8_t, int8_t> possible_queue[4 * kMaxSimulatedPieces];
+  int queue_begin = 0;
+  int queue_end = 0;
+
+  auto placed_at = [&](int x, int y) {
+    for (int i = 0; i < num_placed; ++i) {
+      if (placed_x[i] == x && placed_y[i] == y) {
+        return placed_pieces[i];
+      }
+    }
+    return PIECE_EMPTY;
+  };
+
+  auto is_empty = [&](int x, int y) {
+    return at(x, y) == PIECE_EMPTY && placed_at(x, y) == PIECE_EMPTY;
+  };
+
+  auto place = [&](int x, int y, Piece piece) {
+    placed_x[num_placed] = x;
+    placed_y[num_placed] = y;
+    placed_pieces[num_placed] = piece;
+    ++num_placed;
+
+    // Add neighboring cells to the queue as forced play candidates.
+    for (int j = 0; j < 4; ++j) {
+      const int nx = x + kDx[j];
+      const int ny = y + kDy[j];
+      if (nx < begin_x || ny < begin_y || nx >= end_x || ny >= end_y) {
+        continue;
+      }
+      if (is_empty(nx, ny)) {
+        possible_queue[queue_end].first = nx;
+        possible_queue[queue_end].second = ny;
+        ++queue_end;
+      }
+    }
+  };
+
+  place(move.x, move.y, move.piece);
+
+  while (queue_begin < queue_end) {
+    const int x = possible_queue[queue_begin].first;
+    const int y = possible_queue[queue_begin].second;
+    ++queue_begin;
+
+    if (!is_empty(x, y)) {
+      continue;
+    }
+
+    // Possible pieces of the cell with the pieces on the board, narrowed
+    // down by the simulated pieces around it, as PutPiece() does.
+    PieceSet pieces = (1 << NUM_PIECES) - 1;
+    if ((board_->frontier[column(x)] >> row(y)) & 1) {
+      pieces = board_->possible_pieces[column(x)][row(y)];
+    }
+    for (int i = 0; i < 4; ++i) {
+      const Piece neighbor = placed_at(x + kDx[i], y + kDy[i]);
+      if (neighbor != PIECE_EMPTY) {
+        pieces &= kEdgeCompatiblePiecesTable[i][
+            (kPieceRedEdges[neighbor] >> ((i + 2) & 3)) & 1];
+      }
+    }
+
+    if (pieces == 0 || pieces == (1 << PIECE_EMPTY)) {
+      // No possible piece including empty one for the location.
+      return false;
+    }
+
+    if (!kForcedPlayTable[pieces]) {
+      continue;
+    }
+
+    if (num_placed == kMaxSimulatedPieces) {
+      // Too long chain of forced plays to simulate. Try the move instead.
+      Position next_position;
+      if (!DoMove<rule_set>(move, &next_position)) {
+        return false;
+      }
+      if (hash != nullptr) {
+        *hash = next_position.Hash();
+      }
+      return true;
+    }
+
+    for (int i = 1; i < NUM_PIECES; ++i) {
+      if ((pieces >> i) & 1) {
+        place(x, y, static_cast<Piece>(i));
+        break;
+      }
+    }
+  }
+
+  if (hash != nullptr) {
+    // Same as DoMove() does, but only for the simulated pieces.
+    PositionHash key = keys_[0];
+    if (begin_x < 0) {
+      key *= kZobristShiftX;
+    }
+    if (begin_y < 0) {
+      key *= kZobristShiftY;
+    }
+    for (int i = 0; i < num_placed; ++i) {
+      key += kZobristXTable[placed_x[i] - begin_x][placed_pieces[i]] *
+          kZobristYTable[placed_y[i] - begin_y];
+    }
+    *hash = FinalizeKey(key, !red_to_move_);
+  }
+
+  return true;
+}
+
+template <RuleSet rule_set>
+bool Position::DoMove(Move move, Position *next_position) const {
+  assert(next_position != nullptr);
+  assert(next_position != this);
+  assert(move.piece != PIECE_EMPTY);
+
+  // Moves out of the board of 8x8 Trax are rejected by the callers.
+  assert(!RuleSetTraits<rule_set>::kLimitedBoard ||
+         !IsOutOfLimitedBoard(move));
+
+  if (finished()) {
+    // Every move after the game finished is illegal.
+    return false;
+  }
+
+  // Flip the side to move.
+  next_position->red_to_move_ = !red_to_move_;
+
+  // next_position may be reused, so reset everything FillForcedPieces()
+  // fills.
+  next_position->red_winner_ = false;
+  next_position->white_winner_ = false;
+  next_position->red_winning_reason_ = WINNING_REASON_UNKNOWN;
+  next_position->white_winning_reason_ = WINNING_REASON_UNKNOWN;
+  next_position->undo_stack_.clear();
+  next_position->placed_cells_.clear();
+  std::copy(keys_, keys_ + kNumBoardSymmetries, next_position->keys_);
+
+  // Extend the field width and height if it is required by the move.
+  int next_max_x = max_x_;
+  int next_max_y = max_y_;
+  int offset_x = 0, offset_y = 0;
+  int grow_x = 0, grow_y = 0;
+
+  if (move.x < 0) {
+    ++offset_x;
+    ++next_max_x;
+    grow_x = -1;
+  } else if (move.x >= max_x_) {
+    ++next_max_x;
+    grow_x = 1;
+  }
+
+  if (move.y < 0) {
+    ++offset_y;
+    ++next_max_y;
+    grow_y = -1;
+  } else if (move.y >= max_y_) {
+    ++next_max_y;
+    grow_y = 1;
+  }
+
+  GrowSymmetricKeys(grow_x, grow_y, next_position->keys_);
+
+  if (next_max_x > kMaxBoardSize || next_max_y > kMaxBoardSize) {
+    // The board buffer cannot hold the position.
+    return false;
+  }
+
+  // The buffer is reused if next_position already has one. Growing the
+  // board only moves the origin, so the pieces are never moved.
+  CopyBoardTo(next_position);
+  next_position->Resize(next_max_x, next_max_y, offset_x, offset_y);
+
+  // Don't forget to add the new piece!
+  next_position->PutPiece<rule_set>(move.x + offset_x, move.y + offset_y,
+                                   move.piece);
+
+  // The move is illegal when forced play is applied.
+  if (!next_position->FillForcedPieces<rule_set>(
+          move.x + offset_x, move.y + offset_y,
+          /* placed_cells = */ nullptr)) {
+    return false;
+  }
+
+  return true;
+}
+
+template <RuleSet rule_set>
+bool Position::MakeMove(Move move) {
+  assert(move.piece != PIECE_EMPTY);
+
+  // Moves out of the board of 8x8 Trax are rejected by the callers.
+  assert(!RuleSetTraits<rule_set>::kLimitedBoard ||
+         !IsOutOfLimitedBoard(move));
+
+  if (finished()) {
+    // Every move after the game finished is illegal.
+    return false;
+  }
+
+  // Extend the field width and height if it is required by the move.
+  int next_max_x = max_x_;
+  int next_max_y = max_y_;
+  int offset_x = 0, offset_y = 0;
+  int grow_x = 0, grow_y = 0;
+
+  if (move.x < 0) {
+    ++offset_x;
+    ++next_max_x;
+    grow_x = -1;
+  } else if (move.x >= max_x_) {
+    ++next_max_x;
+    grow_x = 1;
+  }
+
+  if (move.y < 0) {
+    ++offset_y;
+    ++next_max_y;
+    grow_y = -1;
+  } else if (move.y >= max_y_) {
+    ++next_max_y;
+    grow_y = 1;
+  }
+
+  if (next_max_x > kMaxBoardSize || next_max_y > kMaxBoardSize) {
+    // The board buffer cannot hold the position.
+    return false;
+  }
+
+  if (board_ == nullptr) {
+    board_ = AcquireBoardBuffer();
+  }
+
+  UndoRecord record;
+  record.first_placed_cell = placed_cells_.size();
+  record.max_x = max_x_;
+  record.max_y = max_y_;
+  record.offset_x = offset_x;
+  record.offset_y = offset_y;
+  std::copy(keys_, keys_ + kNumBoardSymmetries, record.keys);
+  record.red_winner = red_winner_;
+  record.white_winner = white_winner_;
+  record.red_winning_reason = red_winning_reason_;
+  record.white_winning_reason = white_winning_reason_;
+  undo_stack_.push_back(record);
+
+  if (next_max_x != max_x_ || next_max_y != max_y_) {
+    Resize(next_max_x, next_max_y, offset_x, offset_y);
+  }
+  GrowSymmetricKeys(grow_x, grow_y, keys_);
+
+  // Flip the side to move.
+  red_to_move_ = !red_to_move_;
+
+  const int x = move.x + offset_x;
+  const int y = move.y + offset_y;
+  placed_cells_.emplace_back();
+  PutPiece<rule_set>(x, y, move.piece, &placed_cells_.back());
+
+  // The move is illegal when forced play is applied.
+  if (!FillForcedPieces<rule_set>(x, y, &placed_cells_)) {
+    UnmakeMove();
+    return false;
+  }
+
+  return true;
+}
+
+void Position::UnmakeMove() {
+  assert(!undo_stack_.empty());
+  const UndoRecord& record = undo_stack_.back();
+
+  // Remove the pieces including forced plays, in the reverse order.
+  const int num_placed_cells = placed_cells_.size();
+  for (int i = num_placed_cells - 1; i >= record.first_placed_cell; --i) {
+    RemovePiece(placed_cells_[i]);
+  }
+  placed_cells_.resize(record.first_placed_cell);
+
+  if (record.max_x != max_x_ || record.max_y != max_y_) {
+    Resize(record.max_x, record.max_y, -record.offset_x, -record.offset_y);
+  }
+
+  red_to_move_ = !red_to_move_;
+  std::copy(record.keys, record.keys + kNumBoardSymmetries, keys_);
+  red_winner_ = record.red_winner;
+  white_winner_ = record.white_winner;
+  red_winning_reason_ = record.red_winning_reason;
+  white_winning_reason_ = record.white_winning_reason;
+
+  undo_stack_.pop_back();
+}
+
+PositionHash Position::CanonicalHash(int* symmetry) const {
+  PositionHash min_key = keys_[0] ^ (red_to_move_ ? kZobristRedToMove : 0);
+  int min_symmetry = 0;
+  for (int i = 0; i < kNumSymmetries; ++i) {
+    // The key of the board with swapped colors is the negation of it. See
+    // kZobristXTable.
+    const bool swap_colors = i & kSymmetrySwapColors;
+    PositionHash key = keys_[i % kNumBoardSymmetries];
+    if (swap_colors) {
+      key = -key;
+    }
+    if (red_to_move_ != swap_colors) {
+      key ^= kZobristRedToMove;
+    }
+    if (key < min_key) {
+      min_key = key;
+      min_symmetry = i;
+    }
+  }
+
+  if (symmetry != nullptr) {
+    *symmetry = min_symmetry;
+  }
+  return FinalizeKey(min_key, false);
+}
+
+Move Position::TransformMove(Move move, int symmetry) const {
+  if (move.piece == PIECE_EMPTY) {
+    return move;
+  }
+  int x = move.x, y = move.y;
+  TransformCoordinates(symmetry, max_x_, max_y_, &x, &y);
+  return Move(x, y, kTransformedPieceTable[symmetry][move.piece]);
+}
+
+Move Position::InverseTransformMove(Move move, int symmetry) const {
+  if (move.piece == PIECE_EMPTY) {
+    return move;
+  }
+  // Flip on the transformed board, then transpose it back.
+  int max_x = max_x_, max_y = max_y_;
+  if (symmetry & kSymmetryTranspose) {
+    std::swap(max_x, max_y);
+  }
+  int x = move.x, y = move.y;
+  TransformCoordinates(symmetry & (kSymmetryFlipX | kSymmetryFlipY),
+                       max_x, max_y, &x, &y);
+  TransformCoordinates(symmetry & kSymmetryTranspose, max_x, max_y, &x, &y);
+  return Move(x, y, kInverseTransformedPieceTable[symmetry][move.piece]);
+}
+
+void Position::CopyTo(Position* to) const {
+  assert(to != this);
+
+  if (board_ == nullptr) {
+    to->Clear();
+    return;
+  }
+
+  CopyBoardTo(to);
+  to->red_to_move_ = red_to_move_;
+  std::copy(keys_, keys_ + kNumBoardSymmetries, to->keys_);
+  to->red_winner_ = red_winner_;
+  to->white_winner_ = white_winner_;
+  to->red_winning_reason_ = red_winning_reason_;
+  to->white_winning_reason_ = white_winning_reason_;
+  to->undo_stack_.clear();
+  to->placed_cells_.clear();
+}
+
+void Position::CopyBoardTo(Position* to) const {
+  assert(to != this);
+
+  if (to->board_ == nullptr) {
+    to->board_ = AcquireBoardBuffer();
+  } else if (board_ == nullptr) {
+    to->ClearBoard();
+  } else {
+    // Columns of the board are overwritten below, so only the other columns
+    // of to have to be emptied.
+    const int begin_column = column(-2);
+    for (int i_x = -2; i_x < to->max_x_ + 2; ++i_x) {
+      const int column = to->column(i_x);
+      if (((column - begin_column) & (kBoardCapacity - 1)) >= max_x_ + 4) {
+        ClearColumn(to->board_, column);
+      }
     }
-    std::reverse(columns.begin(), columns.end());
-    trax_notation << columns;
   }
 
-  trax_notation << y + 1;
-  trax_notation << kPieceNotations[piece];
-  return trax_notation.str();
+  to->origin_x_ = origin_x_;
+  to->origin_y_ = origin_y_;
+  to->max_x_ = max_x_;
+  to->max_y_ = max_y_;
+  to->num_pieces_ = num_pieces_;
+  if (board_ == nullptr) {
+    return;
+  }
+
+  // Cells out of the board are empty, so copying the whole columns of the
+  // cells also empties the rest of the columns of to.
+  const int begin_row = row(-2);
+  const int num_rows = max_y_ + 4;
+  for (int i_x = -2; i_x < max_x_ + 2; ++i_x) {
+    const int column = this->column(i_x);
+    std::memcpy(to->board_->cells + column * kBoardCapacity,
+                board_->cells + column * kBoardCapacity, kBoardCapacity);
+    std::memcpy(to->board_->possible_pieces[column],
+                board_->possible_pieces[column],
+                sizeof(board_->possible_pieces[column]));
+    CopyRows(board_->line_ends[column], to->board_->line_ends[column],
+             begin_row, num_rows);
+
+    to->board_->occupied[column] = board_->occupied[column];
+    for (int i = 0; i < 4; ++i) {
+      to->board_->red_edges[i][column] = board_->red_edges[i][column];
+    }
+    to->board_->frontier[column] = board_->frontier[column];
+  }
 }
 
-std::vector<Move> Position::GenerateMoves() const {
-  std::vector<Move> moves;
+void Position::ClearBoard() {
+  if (board_ == nullptr) {
+    return;
+  }
+  for (int i_x = -2; i_x < max_x_ + 2; ++i_x) {
+    ClearColumn(board_, column(i_x));
+  }
+}
 
-  moves.reserve(32);
+void Position::ReleaseBoard() {
+  ClearBoard();
+  ReleaseBoardBuffer(board_);
+  board_ = nullptr;
+}
 
-  if (finished()) {
-    // This is a finished game.
-    return moves;
+template <RuleSet rule_set>
+void Position::PutPiece(int x, int y, Piece piece, PlacedCell* placed_cell) {
+  assert(at(x, y) == PIECE_EMPTY);
+  assert(0 <= x && x < max_x_ && 0 <= y && y < max_y_);
+  at(x, y) = piece;
+  ++num_pieces_;
+  for (int i = 0; i < kNumBoardSymmetries; ++i) {
+    int transformed_x = x, transformed_y = y;
+    TransformCoordinates(i, max_x_, max_y_, &transformed_x, &transformed_y);
+    keys_[i] +=
+        kZobristXTable[transformed_x][kTransformedPieceTable[i][piece]] *
+        kZobristYTable[transformed_y];
   }
 
-  // If this is the first step then they are only valid moves.
-  if (max_x_ == 0 && max_y_ == 0) {
-    moves.emplace_back("@0/", *this);
-    moves.emplace_back("@0+", *this);
-    return moves;
+  const int piece_column = column(x);
+  const uint64_t bit = 1ULL << row(y);
+  board_->occupied[piece_column] |= bit;
+  for (int i = 0; i < 4; ++i) {
+    if ((kPieceRedEdges[piece] >> i) & 1) {
+      board_->red_edges[i][piece_column] |= bit;
+    }
   }
 
-  // TODO(tetsui): This is very naive implementation but maybe we can
-  // progressively update the possible move list.
-  // (such as using UnionFind tree?)
-  for (int i_x = -1; i_x <= max_x_; ++i_x) {
-    for (int j_y = -1; j_y <= max_y_; ++j_y) {
-      if (at(i_x, j_y) != PIECE_EMPTY) {
-        continue;
-      }
+  if (placed_cell != nullptr) {
+    placed_cell->x = x;
+    placed_cell->y = y;
+    placed_cell->frontier =
+        ((board_->frontier[piece_column] & bit) != 0) << 4;
+  }
 
-      if (FLAGS_trax8x8 &&
-          ((max_x_ >= 8 && (i_x == -1 || i_x == max_x_)) ||
-           (max_y_ >= 8 && (j_y == -1 || j_y == max_y_)))) {
-        // Invalid move for 8x8 Trax.
-        continue;
-      }
+  // Adding a piece only narrows down the possible pieces of the neighbors,
+  // so they are updated without looking at the other neighbors.
+  board_->frontier[piece_column] &= ~bit;
+  for (int i = 0; i < 4; ++i) {
+    const int neighbor_column = column(x + kDx[i]);
+    const int neighbor_row = row(y + kDy[i]);
+    const uint64_t neighbor_bit = 1ULL << neighbor_row;
+    if (board_->occupied[neighbor_column] & neighbor_bit) {
+      continue;
+    }
 
-      PieceSet pieces = GetPossiblePieces(i_x, j_y);
-      // Exclude EMPTY piece for added piece candidates.
-      pieces.reset(PIECE_EMPTY);
+    PieceSet* possible_pieces =
+        &board_->possible_pieces[neighbor_column][neighbor_row];
+    if (placed_cell != nullptr) {
+      placed_cell->frontier |=
+          ((board_->frontier[neighbor_column] & neighbor_bit) != 0) << i;
+      placed_cell->possible_pieces[i] = *possible_pieces;
+    }
 
-      for (int k = 0; k < NUM_PIECES; ++k) {
-        if (pieces.test(k)) {
-          moves.emplace_back(i_x, j_y, static_cast<Piece>(k));
-        }
-      }
+    PieceSet pieces = (1 << NUM_PIECES) - 1;
+    if (board_->frontier[neighbor_column] & neighbor_bit) {
+      pieces = *possible_pieces;
+    }
+    pieces &= kEdgeCompatiblePiecesTable[(i + 2) & 3][
+        (kPieceRedEdges[piece] >> i) & 1];
+    if (pieces == (1 << PIECE_EMPTY)) {
+      // Neither empty nor any piece is possible.
+      pieces = 0;
     }
-  }
 
-  return moves;
-}
+    board_->frontier[neighbor_column] |= neighbor_bit;
+    *possible_pieces = pieces;
+    assert(pieces == kEdgePossiblePiecesTable[
+        edge_key(x + kDx[i], y + kDy[i])]);
+  }
 
-bool Position::DoMove(Move move, Position *next_position) const {
-  assert(next_position != nullptr);
-  assert(next_position != this);
-  assert(move.piece != PIECE_EMPTY);
+  // Connect the red track and the white track of the piece.
+  for (int i = 0; i < 2; ++i) {
+    const bool red_line = i == 0;
+    const int directions =
+        red_line ? kPieceRedEdges[piece] : ~kPieceRedEdges[piece] & 0xf;
+    const WinningReason reason = LinkLineEnds<rule_set>(x, y, directions);
+    if (reason == WINNING_REASON_UNKNOWN) {
+      continue;
+    }
 
-  if (FLAGS_trax8x8 &&
-      ((max_x_ >= 8 && (move.x == -1 || move.x == max_x_)) ||
-       (max_y_ >= 8 && (move.y == -1 || move.y == max_y_)))) {
-    // Invalid move for 8x8 Trax.
-    return false;
+    bool& winner = red_line ? red_winner_ : white_winner_;
+    WinningReason& winning_reason =
+        red_line ? red_winning_reason_ : white_winning_reason_;
+    if (!winner) {
+      winner = true;
+      winning_reason = reason;
+    } else if (winning_reason != reason) {
+      // Both a loop and a victory line are made by a move.
+      // FillForcedPieces() decides the reason.
+      winning_reason = WINNING_REASON_UNKNOWN;
+    }
   }
+}
 
-  if (finished()) {
-    // Every move after the game finished is illegal.
-    return false;
+void Position::RemovePiece(const PlacedCell& placed_cell) {
+  const int x = placed_cell.x;
+  const int y = placed_cell.y;
+  assert(at(x, y) != PIECE_EMPTY);
+  UnlinkLineEnds(x, y, kPieceRedEdges[at(x, y)]);
+  UnlinkLineEnds(x, y, ~kPieceRedEdges[at(x, y)] & 0xf);
+  at(x, y) = PIECE_EMPTY;
+  --num_pieces_;
+
+  const int piece_column = column(x);
+  const uint64_t bit = 1ULL << row(y);
+  board_->occupied[piece_column] &= ~bit;
+  for (int i = 0; i < 4; ++i) {
+    board_->red_edges[i][piece_column] &= ~bit;
   }
 
-  // Be aware of the memory leak!
-  delete[] next_position->board_;
-  next_position->board_ = nullptr;
+  if ((placed_cell.frontier >> 4) & 1) {
+    board_->frontier[piece_column] |= bit;
+  }
+  for (int i = 0; i < 4; ++i) {
+    const int neighbor_column = column(x + kDx[i]);
+    const int neighbor_row = row(y + kDy[i]);
+    const uint64_t neighbor_bit = 1ULL << neighbor_row;
+    if ((placed_cell.frontier >> i) & 1) {
+      board_->frontier[neighbor_column] |= neighbor_bit;
+      board_->possible_pieces[neighbor_column][neighbor_row] =
+          placed_cell.possible_pieces[i];
+    } else {
+      // Occupied neighbors are never in the frontier, so clearing the bit
+      // is harmless for them. This also keeps the frontier out of the
+      // board empty when the board shrinks back.
+      board_->frontier[neighbor_column] &= ~neighbor_bit;
+    }
+  }
+}
 
-  // Flip the side to move.
-  next_position->red_to_move_ = !red_to_move_;
+template <RuleSet rule_set>
+WinningReason Position::LinkLineEnds(int x, int y, int directions) {
+  // The edges of the piece on the track, and the ends of the line through
+  // them, as the piece and the direction.
+  int track_directions[2];
+  bool connected[2];
+  int end_x[2];
+  int end_y[2];
+  int end_directions[2];
+
+  int k = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (((directions >> i) & 1) == 0) {
+      continue;
+    }
 
-  // Extend the field width and height if it is required by the move.
-  next_position->max_x_ = max_x_;
-  next_position->max_y_ = max_y_;
+    assert(k < 2);
+    track_directions[k] = i;
+    const int nx = x + kDx[i];
+    const int ny = y + kDy[i];
+    connected[k] = (board_->occupied[column(nx)] >> row(ny)) & 1;
+    if (connected[k]) {
+      // The line continues to the other end of the line of the neighbor.
+      const uint16_t line_end =
+          board_->line_ends[column(nx)][row(ny)][(i + 2) & 3];
+      end_x[k] = nx + LineEndDx(line_end);
+      end_y[k] = ny + LineEndDy(line_end);
+      end_directions[k] = LineEndDirection(line_end);
+    } else {
+      // The edge is the end of the line.
+      end_x[k] = x;
+      end_y[k] = y;
+      end_directions[k] = i;
+    }
+    ++k;
+  }
+  assert(k == 2);
+
+  if (connected[0] && connected[1] &&
+      end_x[0] == x + kDx[track_directions[1]] &&
+      end_y[0] == y + kDy[track_directions[1]] &&
+      end_directions[0] == ((track_directions[1] + 2) & 3)) {
+    // Both neighbors are on the same line. This is loop.
+    return WINNING_REASON_LOOP;
+  }
 
-  int offset_x = 0, offset_y = 0;
+  board_->line_ends[column(end_x[0])][row(end_y[0])][end_directions[0]] =
+      EncodeLineEnd(end_x[1] - end_x[0], end_y[1] - end_y[0],
+                    end_directions[1]);
+  board_->line_ends[column(end_x[1])][row(end_y[1])][end_directions[1]] =
+      EncodeLineEnd(end_x[0] - end_x[1], end_y[0] - end_y[1],
+                    end_directions[0]);
 
-  if (move.x < 0) {
-    ++offset_x;
-    ++next_position->max_x_;
-  } else if (move.x >= max_x_) {
-    ++next_position->max_x_;
+  if (!RuleSetTraits<rule_set>::kVictoryLine) {
+    return WINNING_REASON_UNKNOWN;
   }
 
-  if (move.y < 0) {
-    ++offset_y;
-    ++next_position->max_y_;
-  } else if (move.y >= max_y_) {
-    ++next_position->max_y_;
+  // Empty cells at the ends. If they are just outside of the opposite
+  // sides of the board, this is victory line.
+  const int empty_x[2] = {end_x[0] + kDx[end_directions[0]],
+                          end_x[1] + kDx[end_directions[1]]};
+  const int empty_y[2] = {end_y[0] + kDy[end_directions[0]],
+                          end_y[1] + kDy[end_directions[1]]};
+  if (max_x_ >= 8 &&
+      std::min(empty_x[0], empty_x[1]) == -1 &&
+      std::max(empty_x[0], empty_x[1]) == max_x_) {
+    return WINNING_REASON_LINE;
   }
+  if (max_y_ >= 8 &&
+      std::min(empty_y[0], empty_y[1]) == -1 &&
+      std::max(empty_y[0], empty_y[1]) == max_y_) {
+    return WINNING_REASON_LINE;
+  }
+
+  return WINNING_REASON_UNKNOWN;
+}
 
-  // Sentinels with its depth 2 is used here.
-  next_position->board_ = new Piece[next_position->board_size()];
+void Position::UnlinkLineEnds(int x, int y, int directions) {
+  // The edges of the neighbors facing the piece, which were the ends of the
+  // lines before the piece was placed, and the other ends of them.
+  bool connected[2];
+  int neighbor_x[2];
+  int neighbor_y[2];
+  int neighbor_directions[2];
+  uint16_t line_ends[2];
 
-  if (max_x_ == next_position->max_x_ && max_y_ == next_position->max_y_) {
-    // Hope it will be vectorized :)
-    std::copy(board_, board_ + board_size(), next_position->board_);
-  } else {
-    // Fill the board with empty pieces.
-    std::fill(next_position->board_,
-              next_position->board_ + next_position->board_size(),
-              PIECE_EMPTY);
-
-    // Copy the board (if exists).
-    if (board_ != nullptr) {
-      for (int i_x = 0; i_x < max_x_; ++i_x) {
-        for (int j_y = 0; j_y < max_y_; ++j_y) {
-          next_position->at(i_x + offset_x, j_y + offset_y) = at(i_x, j_y);
-        }
-      }
+  int k = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (((directions >> i) & 1) == 0) {
+      continue;
+    }
+
+    assert(k < 2);
+    neighbor_x[k] = x + kDx[i];
+    neighbor_y[k] = y + kDy[i];
+    neighbor_directions[k] = (i + 2) & 3;
+    connected[k] =
+        (board_->occupied[column(neighbor_x[k])] >> row(neighbor_y[k])) & 1;
+    if (connected[k]) {
+      // The edge was not a line end since then, so it is not updated.
+      line_ends[k] = board_->line_ends[column(neighbor_x[k])][
+          row(neighbor_y[k])][neighbor_directions[k]];
     }
+    ++k;
   }
+  assert(k == 2);
 
-  // Don't forget to add the new piece!
-  next_position->at(move.x + offset_x, move.y + offset_y) = move.piece;
+  if (connected[0] && connected[1] &&
+      neighbor_x[0] + LineEndDx(line_ends[0]) == neighbor_x[1] &&
+      neighbor_y[0] + LineEndDy(line_ends[0]) == neighbor_y[1] &&
+      LineEndDirection(line_ends[0]) == neighbor_directions[1]) {
+    // The piece made a loop, and nothing was updated.
+    return;
+  }
 
-  // The move is illegal when forced play is applied.
-  if (!next_position->FillForcedPieces(move.x + offset_x,
-                                       move.y + offset_y)) {
-    return false;
+  // Point the other ends back to the neighbors.
+  for (int i = 0; i < 2; ++i) {
+    if (!connected[i]) {
+      continue;
+    }
+    const int dx = LineEndDx(line_ends[i]);
+    const int dy = LineEndDy(line_ends[i]);
+    board_->line_ends[column(neighbor_x[i] + dx)][row(neighbor_y[i] + dy)][
+        LineEndDirection(line_ends[i])] =
+        EncodeLineEnd(-dx, -dy, neighbor_directions[i]);
   }
+}
 
-  return true;
+EdgeKey Position::edge_key(int x, int y) const {
+  assert(-1 <= x && x <= max_x_ && -1 <= y && y <= max_y_);
+  const int center = column(x);
+  const int right = column(x + 1);
+  const int left = column(x - 1);
+  const int bit = row(y);
+  const int top = row(y - 1);
+  const int bottom = row(y + 1);
+  const uint64_t* occupied = board_->occupied;
+  const uint64_t (*red_edges)[kBoardCapacity] = board_->red_edges;
+
+  return static_cast<EdgeKey>(
+      ((occupied[right] >> bit) & 1) |
+      (((red_edges[2][right] >> bit) & 1) << 1) |
+      (((occupied[center] >> top) & 1) << 2) |
+      (((red_edges[3][center] >> top) & 1) << 3) |
+      (((occupied[left] >> bit) & 1) << 4) |
+      (((red_edges[0][left] >> bit) & 1) << 5) |
+      (((occupied[center] >> bottom) & 1) << 6) |
+      (((red_edges[1][center] >> bottom) & 1) << 7));
 }
 
 PieceSet Position::GetPossiblePieces(int x, int y) const {
   assert(at(x, y) == PIECE_EMPTY);
-
-  NeighborKey key = EncodeNeighborKey(
-      at(x + kDx[0], y + kDy[0]),
-      at(x + kDx[1], y + kDy[1]),
-      at(x + kDx[2], y + kDy[2]),
-      at(x + kDx[3], y + kDy[3]));
-  return g_possible_pieces_table[key];
+  return kEdgePossiblePiecesTable[edge_key(x, y)];
 }
 
 void Position::EnumerateLines(std::vector<Line> *lines) const {
   lines->clear();
-  if (finished()) {
+  if (finished() || board_ == nullptr) {
     return;
   }
 
-  // Clockwisely traced external facing edges.
-  std::map<std::pair<int, int>, int> indexed_edges;
-  int total_index;
-
-  // Set of <endpoint_a, endpoint_b, is_red> to keep traced lines unique.
-  std::set<std::tuple<std::pair<int, int>, std::pair<int, int>, bool>> traced;
+  LineScratch* scratch = &g_line_scratch;
+  ++scratch->stamp;
+  if (scratch->stamp == 0) {
+    // Stamps wrapped around. Invalidate everything once.
+    std::memset(scratch->edge_stamps, 0, sizeof(scratch->edge_stamps));
+    std::memset(scratch->emitted_stamps, 0, sizeof(scratch->emitted_stamps));
+    scratch->stamp = 1;
+  }
 
-  // Iterate over cells with external facing edge.
-  for (int i_x = 0; i_x < max_x_; ++i_x) {
-    for (int j_y = 0; j_y < max_y_; ++j_y) {
-      if (at(i_x, j_y) == PIECE_EMPTY) {
-        continue;
+  // Clockwisely traced external facing edges, from the empty cell next to
+  // the first piece in x-major order.
+  int total_index;
+  {
+    const int first_y = __builtin_ctzll(column_bits(board_->occupied, 0)) - 2;
+    for (int k = 0; k < 4; ++k) {
+      const int nx = kDx[k];
+      const int ny = first_y + kDy[k];
+      if (at(nx, ny) == PIECE_EMPTY) {
+        TraceAndIndexEdges(nx, ny, scratch, &total_index);
+        break;
       }
+    }
+  }
+
+  // Every line has two line ends, i.e. edges facing empty cells in the
+  // frontier. Lines are emitted from the smaller end, and the other end is
+  // looked up from BoardBuffer::line_ends.
+  for (int i_x = -1; i_x <= max_x_; ++i_x) {
+    for (uint64_t bits = column_bits(board_->frontier, i_x); bits != 0;
+         bits &= bits - 1) {
+      const int j_y = __builtin_ctzll(bits) - 2;
+      const EdgeKey key = edge_key(i_x, j_y);
 
-      bool is_edge = false;
       for (int k = 0; k < 4; ++k) {
-        const int nx = i_x + kDx[k];
-        const int ny = j_y + kDy[k];
-        if (at(nx, ny) == PIECE_EMPTY) {
-          // The cell at <i_x, j_y> has external facing edge.
-          is_edge = true;
-
-          // Generate indexed_edges if not yet generated.
-          if (indexed_edges.empty()) {
-            TraceAndIndexEdges(nx, ny, &indexed_edges, &total_index);
-          }
-          break;
+        if (((key >> (2 * k)) & 1) == 0) {
+          continue;
         }
-      }
-
-      // Nothing to do if the cell does not have external facing edge.
-      if (!is_edge) {
-        continue;
-      }
-
-      // Trace line from the cell for each color.
-      for (int k_red = 0; k_red < 2; ++k_red) {
-        bool is_red = static_cast<bool>(k_red);
 
-        std::pair<int, int> endpoint_a, endpoint_b;
-
-        // Trace the line.
-        TraceLineToEndpoints(i_x, j_y, is_red, &endpoint_a, &endpoint_b);
+        // The end is the edge of the neighbor facing the cell.
+        const int x = i_x + kDx[k];
+        const int y = j_y + kDy[k];
+        const int direction = (k + 2) & 3;
+        const bool is_red = (key >> (2 * k + 1)) & 1;
+
+        const uint16_t line_end =
+            board_->line_ends[column(x)][row(y)][direction];
+        const int other_x = x + LineEndDx(line_end);
+        const int other_y = y + LineEndDy(line_end);
+        const int other_direction = LineEndDirection(line_end);
+        if (std::make_tuple(x, y, direction) >
+            std::make_tuple(other_x, other_y, other_direction)) {
+          continue;
+        }
 
+        std::pair<int, int> endpoint_a(i_x, j_y);
+        std::pair<int, int> endpoint_b(other_x + kDx[other_direction],
+                                       other_y + kDy[other_direction]);
         if (endpoint_a > endpoint_b) {
           std::swap(endpoint_a, endpoint_b);
         }
-
-        // Skip to add to list if already added.
-        if (traced.count(make_tuple(endpoint_a, endpoint_b, is_red))) {
-          continue;
+        const int i_endpoint_a = index(endpoint_a.first, endpoint_a.second);
+        const int i_endpoint_b = index(endpoint_b.first, endpoint_b.second);
+
+        // Another line of the color can end at the same cells only if the
+        // cell faces more than one edge of the color, i.e. exactly two.
+        // Such a line is counted only once.
+        int num_same_color_ends = 0;
+        for (int l = 0; l < 4; ++l) {
+          if (((key >> (2 * l)) & 1) &&
+              static_cast<bool>((key >> (2 * l + 1)) & 1) == is_red) {
+            ++num_same_color_ends;
+          }
+        }
+        if (num_same_color_ends >= 2) {
+          if (scratch->emitted_stamps[i_endpoint_a][is_red] ==
+              scratch->stamp &&
+              scratch->emitted_lines[i_endpoint_a][is_red] == i_endpoint_b) {
+            continue;
+          }
+          scratch->emitted_stamps[i_endpoint_a][is_red] = scratch->stamp;
+          scratch->emitted_lines[i_endpoint_a][is_red] = i_endpoint_b;
         }
-        traced.insert(make_tuple(endpoint_a, endpoint_b, is_red));
 
-        if (!indexed_edges.count(endpoint_a) ||
-            !indexed_edges.count(endpoint_b)) {
+        if (scratch->edge_stamps[i_endpoint_a] != scratch->stamp ||
+            scratch->edge_stamps[i_endpoint_b] != scratch->stamp) {
           // It is possible that the board has empty region inside.
           // We ignore these cases for now.
           continue;
         }
         Line line(endpoint_a, endpoint_b, is_red, *this,
-                  indexed_edges, total_index);
+                  scratch->edge_indices[i_endpoint_a],
+                  scratch->edge_indices[i_endpoint_b], total_index);
 
         // Add to the list.
         lines->push_back(line);
@@ -748,7 +1986,14 @@ void Position::Dump() const {
   std::cerr << std::endl;
 }
 
-bool Position::FillForcedPieces(int move_x, int move_y) {
+template <RuleSet rule_set>
+bool Position::FillForcedPieces(
+    int move_x, int move_y,
+    std::vector<PlacedCell> *placed_cells) {
+  ForcedPlayScratch* scratch = &g_forced_play_scratch;
+  AdvanceStamp(scratch);
+  const uint32_t stamp = scratch->stamp;
+
   // Winner flags can be filled by performing checking from some checkpoints,
   // but we have to do them after all the forced plays are done,
   // due to some corner cases.
@@ -757,43 +2002,54 @@ bool Position::FillForcedPieces(int move_x, int move_y) {
   // but suddenly forced play filled the rightmost cells.
   //
   // Thus, we have to enumerate all of them first.
-  std::pair<int8_t, int8_t> winner_flag_checkpoints[64];
+  std::pair<int8_t, int8_t>* winner_flag_checkpoints = scratch->checkpoints;
   int num_checkpoints = 0;
 
   winner_flag_checkpoints[num_checkpoints].first = move_x;
   winner_flag_checkpoints[num_checkpoints].second = move_y;
   ++num_checkpoints;
 
-  std::pair<int8_t, int8_t> possible_queue[64];
+  // The queue wraps around, and the number of the queued cells is bounded
+  // by the cells of the board, as a cell is not queued again until it is
+  // popped.
+  const int queue_mask = kBoardCapacity * kBoardCapacity - 1;
+  std::pair<int8_t, int8_t>* possible_queue = scratch->queue;
   int queue_begin = 0;
   int queue_end = 0;
 
-  // Add neighboring cells to the queue as forced play candidates.
-  for (int j = 0; j < 4; ++j) {
-    const int nx = move_x + kDx[j];
-    const int ny = move_y + kDy[j];
+  // Add the empty neighbors of the piece to the queue as forced play
+  // candidates.
+  auto push_neighbors = [&](int x, int y) {
+    for (int j = 0; j < 4; ++j) {
+      const int nx = x + kDx[j];
+      const int ny = y + kDy[j];
 
-    // Forced plays should not happen outside the current board region.
-    // Therefore checking inside [0, max_x) [0, max_y) is enough.
-    if (nx < 0 || ny < 0 || nx >= max_x_ || ny >= max_y_) {
-      continue;
-    }
+      // Forced plays should not happen outside the current board region.
+      // Therefore checking inside [0, max_x) [0, max_y) is enough.
+      if (nx < 0 || ny < 0 || nx >= max_x_ || ny >= max_y_) {
+        continue;
+      }
 
-    if (at(nx, ny) == PIECE_EMPTY) {
-      assert(
-          queue_end + 1 < sizeof(possible_queue) / sizeof(possible_queue[0]));
-      possible_queue[queue_end].first = nx;
-      possible_queue[queue_end].second = ny;
-      ++queue_end;
+      const int i_cell = index(nx, ny);
+      if (board_->cells[i_cell] == PIECE_EMPTY &&
+          scratch->queued_stamps[i_cell] != stamp) {
+        assert(queue_end - queue_begin < max_x_ * max_y_);
+        scratch->queued_stamps[i_cell] = stamp;
+        possible_queue[queue_end & queue_mask].first = nx;
+        possible_queue[queue_end & queue_mask].second = ny;
+        ++queue_end;
+      }
     }
-  }
+  };
+
+  push_neighbors(move_x, move_y);
 
   // Loop while chain of forced plays is happening.
-  // while (!possible_queue.empty()) {
   while (queue_begin < queue_end) {
-    const int x = possible_queue[queue_begin].first;
-    const int y = possible_queue[queue_begin].second;
+    const int x = possible_queue[queue_begin & queue_mask].first;
+    const int y = possible_queue[queue_begin & queue_mask].second;
     ++queue_begin;
+    scratch->queued_stamps[index(x, y)] = 0;
 
     // A place may be filled after the coordinate is pushed to the queue,
     // before the coordinate is popped.
@@ -801,73 +2057,92 @@ bool Position::FillForcedPieces(int move_x, int move_y) {
       continue;
     }
 
-    const PieceSet pieces = GetPossiblePieces(x, y);
+    // The cell is next to a placed piece, so its possible pieces are
+    // already updated by PutPiece().
+    assert((board_->frontier[column(x)] >> row(y)) & 1);
+    const PieceSet pieces = board_->possible_pieces[column(x)][row(y)];
     // No possible piece including empty one for the location.
     // The whole position is invalid.
-    if (pieces.count() == 0) {
+    if (pieces == 0) {
       return false;
     }
 
     // This is forced play.
-    const bool is_forced_play = g_forced_play_table[
-        EncodeNeighborKey(
-          at(x + kDx[0], y + kDy[0]),
-          at(x + kDx[1], y + kDy[1]),
-          at(x + kDx[2], y + kDy[2]),
-          at(x + kDx[3], y + kDy[3]))];
-
-    if (!is_forced_play) {
+    if (!kForcedPlayTable[pieces]) {
       continue;
     }
 
-    assert(pieces.count() == 2);
+    assert(__builtin_popcount(pieces) == 2);
 
     for (int i = 1; i < NUM_PIECES; ++i) {
-      if (pieces.test(i)) {
-        assert(at(x, y) == PIECE_EMPTY);
-
+      if ((pieces >> i) & 1) {
         // Place the forced piece.
-        at(x, y) = static_cast<Piece>(i);
+        if (placed_cells != nullptr) {
+          placed_cells->emplace_back();
+          PutPiece<rule_set>(x, y, static_cast<Piece>(i),
+                             &placed_cells->back());
+        } else {
+          PutPiece<rule_set>(x, y, static_cast<Piece>(i));
+        }
         break;
       }
     }
 
     // Add the coordinate to winner flag checkpoints, because
     // it may constitute new loop or victory line.
-    assert(
-        num_checkpoints + 1 <
-        sizeof(winner_flag_checkpoints) / sizeof(winner_flag_checkpoints[0]));
+    assert(num_checkpoints < max_x_ * max_y_);
     winner_flag_checkpoints[num_checkpoints].first = x;
     winner_flag_checkpoints[num_checkpoints].second = y;
     ++num_checkpoints;
 
     // Add neighboring cells to the queue as new forced play candidates.
-    for (int j = 0; j < 4; ++j) {
-      const int nx = x + kDx[j];
-      const int ny = y + kDy[j];
+    push_neighbors(x, y);
+  }
 
-      // Forced plays should not happen outside the current board region.
-      // Therefore checking inside [0, max_x) [0, max_y) is enough.
-      if (nx < 0 || ny < 0 || nx >= max_x_ || ny >= max_y_) {
-        continue;
-      }
+  FinalizeWinnerFlags<rule_set>(winner_flag_checkpoints, num_checkpoints,
+                                scratch);
+  return true;
+}
 
-      if (at(nx, ny) == PIECE_EMPTY) {
-        assert(
-            queue_end + 1 <
-            sizeof(possible_queue) / sizeof(possible_queue[0]));
-        possible_queue[queue_end].first = nx;
-        possible_queue[queue_end].second = ny;
-        ++queue_end;
-      }
+template <RuleSet rule_set>
+void Position::FinalizeWinnerFlags(
+    const std::pair<int8_t, int8_t>* checkpoints, int num_checkpoints,
+    ForcedPlayScratch* scratch) {
+  // Winner flags are already filled by PutPiece() as the lines are
+  // connected. If a player made both a loop and a victory line, the reason
+  // is left unknown, and it is taken from the line of the first checkpoint
+  // by tracing them.
+  bool retrace =
+      (red_winner_ && red_winning_reason_ == WINNING_REASON_UNKNOWN) ||
+      (white_winner_ && white_winning_reason_ == WINNING_REASON_UNKNOWN);
+#ifndef NDEBUG
+  // Cross-check the flags with tracing in debug builds.
+  retrace = true;
+  const bool linked_red_winner = red_winner_;
+  const bool linked_white_winner = white_winner_;
+  const WinningReason linked_red_winning_reason = red_winning_reason_;
+  const WinningReason linked_white_winning_reason = white_winning_reason_;
+#endif
+
+  if (retrace) {
+    red_winner_ = false;
+    white_winner_ = false;
+    red_winning_reason_ = WINNING_REASON_UNKNOWN;
+    white_winning_reason_ = WINNING_REASON_UNKNOWN;
+    for (int i = 0; i < num_checkpoints; ++i) {
+      FillWinnerFlags<rule_set>(checkpoints[i].first, checkpoints[i].second,
+                                scratch);
     }
   }
 
-  // Fill winner flags based on the position state.
-  for (int i = 0; i < num_checkpoints; ++i) {
-    FillWinnerFlags(winner_flag_checkpoints[i].first,
-                    winner_flag_checkpoints[i].second);
-  }
+#ifndef NDEBUG
+  assert(red_winner_ == linked_red_winner);
+  assert(white_winner_ == linked_white_winner);
+  assert(linked_red_winning_reason == WINNING_REASON_UNKNOWN ||
+         linked_red_winning_reason == red_winning_reason_);
+  assert(linked_white_winning_reason == WINNING_REASON_UNKNOWN ||
+         linked_white_winning_reason == white_winning_reason_);
+#endif
 
   if (red_winner_ && white_winner_) {
     // This is a win for the player who made the last move.
@@ -879,24 +2154,11 @@ bool Position::FillForcedPieces(int move_x, int move_y) {
     }
   }
 
-  if (FLAGS_trax8x8 && !finished() && max_x_ >= 8 && max_y_ >= 8) {
+  if (RuleSetTraits<rule_set>::kLimitedBoard &&
+      !finished() && max_x_ >= 8 && max_y_ >= 8) {
     // For 8x8 Trax, if region is filled without any victory lines or loops,
     // the game is considered draw.
-
-    bool all_filled = true;
-    for (int i_x = 0; i_x < max_x_; ++i_x) {
-      for (int j_y = 0; j_y < max_y_; ++j_y) {
-        if (at(i_x, j_y) == PIECE_EMPTY) {
-          all_filled = false;
-          break;
-        }
-      }
-      if (all_filled) {
-        break;
-      }
-    }
-
-    if (all_filled) {
+    if (num_pieces_ == max_x_ * max_y_) {
       red_winner_ = true;
       white_winner_ = true;
 
@@ -904,39 +2166,45 @@ bool Position::FillForcedPieces(int move_x, int move_y) {
       white_winning_reason_ = WINNING_REASON_FULL;
     }
   }
-
-  return true;
 }
 
-void Position::FillWinnerFlags(int x, int y) {
+template <RuleSet rule_set>
+void Position::FillWinnerFlags(int x, int y, ForcedPlayScratch* scratch) {
   assert(at(x, y) != PIECE_EMPTY);
 
   WinningReason reason;
+  const uint32_t* traced_stamps = scratch->traced_stamps[index(x, y)];
 
-  if (!red_winner_ &&
-      (reason = TraceVictoryLineOrLoop(x, y, /* red_line = */ true)) !=
+  if (!red_winner_ && traced_stamps[1] != scratch->stamp &&
+      (reason = TraceVictoryLineOrLoop<rule_set>(
+          x, y, /* red_line = */ true, scratch)) !=
       WINNING_REASON_UNKNOWN) {
     red_winner_ = true;
     red_winning_reason_ = reason;
   }
 
-  if (!white_winner_ &&
-      (reason = TraceVictoryLineOrLoop(x, y, /* red_line = */ false)) !=
+  if (!white_winner_ && traced_stamps[0] != scratch->stamp &&
+      (reason = TraceVictoryLineOrLoop<rule_set>(
+          x, y, /* red_line = */ false, scratch)) !=
       WINNING_REASON_UNKNOWN) {
     white_winner_ = true;
     white_winning_reason_ = reason;
   }
 }
 
+template <RuleSet rule_set>
 WinningReason Position::TraceVictoryLineOrLoop(int start_x, int start_y,
-                                      bool red_line) {
+                                               bool red_line,
+                                               ForcedPlayScratch* scratch) {
   assert(at(start_x, start_y) != PIECE_EMPTY);
   assert(0 <= start_x && start_x < max_x_ && 0 <= start_y && start_y < max_y_);
 
   const char traced_color = red_line ? 'R' : 'W';
+  scratch->traced_stamps[index(start_x, start_y)][red_line] = scratch->stamp;
 
-  // Omit edge hit detection for most of the boards.
-  if (max_x_ < 8 && max_y_ < 8) {
+  // Omit edge hit detection for most of the boards, and for Loop Trax.
+  if (!RuleSetTraits<rule_set>::kVictoryLine ||
+      (max_x_ < 8 && max_y_ < 8)) {
     // Traces line to two directions with the edges of the given color.
     for (int i = 0; i < 4; ++i) {
       if (kPieceColors[at(start_x, start_y)][i] != traced_color) {
@@ -959,10 +2227,11 @@ WinningReason Position::TraceVictoryLineOrLoop(int start_x, int start_y,
         }
 
         assert(0 <= x && x < max_x_ && 0 <= y && y < max_y_);
+        scratch->traced_stamps[index(x, y)][red_line] = scratch->stamp;
 
         // Continue tracing the line.
         const int next_direction =
-          g_track_direction_table[at(x, y)][previous_direction];
+          kTrackDirectionTable[at(x, y)][previous_direction];
 
         x += kDx[next_direction];
         y += kDy[next_direction];
@@ -1012,12 +2281,13 @@ WinningReason Position::TraceVictoryLineOrLoop(int start_x, int start_y,
       }
 
       assert(0 <= x && x < max_x_ && 0 <= y && y < max_y_);
+      scratch->traced_stamps[index(x, y)][red_line] = scratch->stamp;
 
       const int xy[2] = {x, y};
 
       // Continue tracing the line.
       const int next_direction =
-        g_track_direction_table[at(x, y)][previous_direction];
+        kTrackDirectionTable[at(x, y)][previous_direction];
 
       if (edges[next_direction] == xy[next_direction & 1]) {
         // You hit the edge.
@@ -1044,45 +2314,28 @@ WinningReason Position::TraceVictoryLineOrLoop(int start_x, int start_y,
   return WINNING_REASON_UNKNOWN;
 }
 
-void Position::TraceLineToEndpoints(int x, int y, bool red_line,
-                                    std::pair<int, int> *endpoint_a,
-                                    std::pair<int, int> *endpoint_b) const {
-  const char traced_color = red_line ? 'R' : 'W';
-
-  bool first = true;
-  for (int i = 0; i < 4; ++i) {
-    Piece piece = at(x, y);
-    if (kPieceColors[piece][i] != traced_color) {
-      continue;
-    }
-
-    int nx = x + kDx[i];
-    int ny = y + kDy[i];
-    int previous_direction = (i + 2) & 3;
-    while (at(nx, ny) != PIECE_EMPTY) {
-      // Tracing the line.
-      const int next_direction =
-        g_track_direction_table[at(nx, ny)][previous_direction];
-
-      nx += kDx[next_direction];
-      ny += kDy[next_direction];
-      previous_direction = (next_direction + 2) & 3;
-    }
-
-    if (first) {
-      *endpoint_a = std::make_pair(nx, ny);
-    } else {
-      *endpoint_b = std::make_pair(nx, ny);
-    }
-
-    first = false;
-  }
-}
-
-void Position::TraceAndIndexEdges(
-    int start_x, int start_y,
-    std::map<std::pair<int, int>, int> *indexed_edges,
-    int *total_index) const {
+// Instantiation.
+
+#define INSTANTIATE_TEMPLATES_FOR(RULE_SET) \
+  template void Position::GenerateMoves<RULE_SET>(MoveList* moves) const; \
+  template void Position::GenerateLegalMoves<RULE_SET>( \
+      MoveList* moves) const; \
+  template void Position::GenerateUniqueMoves<RULE_SET>( \
+      MoveList* moves) const; \
+  template bool Position::IsPossibleMove<RULE_SET>(Move move) const; \
+  template bool Position::IsLegalMove<RULE_SET>( \
+      Move move, PositionHash* hash) const; \
+  template bool Position::DoMove<RULE_SET>( \
+      Move move, Position *next_position) const; \
+  template bool Position::MakeMove<RULE_SET>(Move move)
+
+INSTANTIATE_TEMPLATES_FOR(RULE_SET_TRAX);
+INSTANTIATE_TEMPLATES_FOR(RULE_SET_TRAX_8X8);
+INSTANTIATE_TEMPLATES_FOR(RULE_SET_LOOP_TRAX);
+
+void Position::TraceAndIndexEdges(int start_x, int start_y,
+                                  LineScratch *scratch,
+                                  int *total_index) const {
   int x = start_x;
   int y = start_y;
   int previous_direction = -1;
@@ -1121,7 +2374,12 @@ void Position::TraceAndIndexEdges(
   int current_index = 0;
 
   while (true) {
-    indexed_edges->insert(std::make_pair(std::make_pair(x, y), current_index));
+    // A cell may be visited more than once. Keep the first index.
+    const int i_cell = index(x, y);
+    if (scratch->edge_stamps[i_cell] != scratch->stamp) {
+      scratch->edge_stamps[i_cell] = scratch->stamp;
+      scratch->edge_indices[i_cell] = current_index;
+    }
     ++current_index;
 
     // Trace in clockwise order.
@@ -1153,10 +2411,13 @@ Line::Line(const std::pair<int, int>& endpoint_a,
            const std::pair<int, int>& endpoint_b,
            bool is_red,
            const Position& position,
-           const std::map<std::pair<int, int>, int>& indexed_edges,
+           int endpoint_index_a,
+           int endpoint_index_b,
            int total_index)
     : is_red(is_red)
-    , is_inner(false) {
+    , is_inner(false)
+    , endpoint_index_a(endpoint_index_a)
+    , endpoint_index_b(endpoint_index_b) {
   loop_distances[0] = 0;
   loop_distances[1] = 0;
 
@@ -1170,12 +2431,6 @@ Line::Line(const std::pair<int, int>& endpoint_a,
     edge_distances[i] = maxs[i] - 1 - (uppers[i] - 1) + (lowers[i] + 1);
   }
 
-  assert(indexed_edges.find(endpoint_a) != indexed_edges.end());
-  assert(indexed_edges.find(endpoint_b) != indexed_edges.end());
-
-  endpoint_index_a = indexed_edges.find(endpoint_a)->second;
-  endpoint_index_b = indexed_edges.find(endpoint_b)->second;
-
   int lower_index = endpoint_index_a;
   int upper_index = endpoint_index_b;
   if (lower_index > upper_index) {
@@ -1194,6 +2449,74 @@ Line::Line(const std::pair<int, int>& endpoint_a,
 #endif
 }
 
+void PackedBoard::Pack(const Position& position) {
+  max_x_ = position.max_x();
+  max_y_ = position.max_y();
+  red_to_move_ = position.red_to_move();
+  cells_.assign((max_x_ * max_y_ + 1) / 2, 0);
+
+  int i = 0;
+  for (int i_x = 0; i_x < max_x_; ++i_x) {
+    for (int j_y = 0; j_y < max_y_; ++j_y, ++i) {
+      cells_[i >> 1] |= position.at(i_x, j_y) << ((i & 1) << 2);
+    }
+  }
+}
+
+void PackedBoard::Unpack(Position* position) const {
+  switch (GetRuleSet()) {
+    case RULE_SET_TRAX_8X8:
+      Unpack<RULE_SET_TRAX_8X8>(position);
+      break;
+    case RULE_SET_LOOP_TRAX:
+      Unpack<RULE_SET_LOOP_TRAX>(position);
+      break;
+    default:
+      Unpack<RULE_SET_TRAX>(position);
+      break;
+  }
+}
+
+template <RuleSet rule_set>
+void PackedBoard::Unpack(Position* position) const {
+  position->Clear();
+  position->red_to_move_ = red_to_move_;
+  if (max_x_ == 0) {
+    return;
+  }
+
+  // PutPiece() only needs the neighbors placed so far, so the pieces are
+  // placed in any order on the board of the final size.
+  position->board_ = AcquireBoardBuffer();
+  position->Resize(max_x_, max_y_, 0, 0);
+  for (int i_x = 0; i_x < max_x_; ++i_x) {
+    for (int j_y = 0; j_y < max_y_; ++j_y) {
+      const Piece piece = at(i_x, j_y);
+      if (piece != PIECE_EMPTY) {
+        position->PutPiece<rule_set>(i_x, j_y, piece);
+      }
+    }
+  }
+
+  // Any piece may be the last one of a loop or a victory line, so all of
+  // them are the checkpoints to resolve the winner flags.
+  ForcedPlayScratch* scratch = &g_forced_play_scratch;
+  AdvanceStamp(scratch);
+  std::pair<int8_t, int8_t>* checkpoints = scratch->checkpoints;
+  int num_checkpoints = 0;
+  for (int i_x = 0; i_x < max_x_; ++i_x) {
+    for (int j_y = 0; j_y < max_y_; ++j_y) {
+      if (at(i_x, j_y) != PIECE_EMPTY) {
+        checkpoints[num_checkpoints].first = i_x;
+        checkpoints[num_checkpoints].second = j_y;
+        ++num_checkpoints;
+      }
+    }
+  }
+  position->FinalizeWinnerFlags<rule_set>(checkpoints, num_checkpoints,
+                                          scratch);
+}
+
 void StartTraxClient(Searcher* searcher) {
   assert(searcher != nullptr);
 
@@ -1411,8 +2734,28 @@ void StartMultipleSelfGames(Searcher* white_searcher, Searcher* red_searcher,
   }
 }
 
+namespace {
+
+// Same as Position::DoMove(), but follows the given rule set instead of
+// GetRuleSet().
+bool DoMoveByRuleSet(const Position& position, Move move, RuleSet rule_set,
+                     Position* next_position) {
+  switch (rule_set) {
+    case RULE_SET_TRAX_8X8:
+      return !position.IsOutOfLimitedBoard(move) &&
+          position.DoMove<RULE_SET_TRAX_8X8>(move, next_position);
+    case RULE_SET_LOOP_TRAX:
+      return position.DoMove<RULE_SET_LOOP_TRAX>(move, next_position);
+    default:
+      return position.DoMove<RULE_SET_TRAX>(move, next_position);
+  }
+}
+
+}  // namespace
+
 void ParseCommentedGames(const std::string& filename,
-                         std::vector<Game> *games) {
+                         std::vector<Game> *games,
+                         RuleSet rule_set) {
   games->clear();
 
   std::ifstream ifs(filename);
@@ -1424,7 +2767,8 @@ void ParseCommentedGames(const std::string& filename,
   std::string line;
   Position position;
   Game game;
-  std::string game_kind;
+  // Rule set of the game, or NUM_RULE_SETS if it is unknown.
+  RuleSet game_rule_set = NUM_RULE_SETS;
 
   // TODO(tetsui): This function is dirty.
 
@@ -1434,19 +2778,26 @@ void ParseCommentedGames(const std::string& filename,
 
     if (line[0] == '#') {
       if (!game.moves.empty()) {
-        if (game_kind == "Trax") {
+        if (game_rule_set == rule_set) {
           games->push_back(game);
         }
-        game_kind = "";
+        game_rule_set = NUM_RULE_SETS;
         position.Clear();
         game.Clear();
       }
       continue;
     }
 
-    if (line == "8x8 Trax" || line == "8x8Trax" ||
-        line == "Loop Trax" || line == "Trax") {
-      game_kind = line;
+    if (line == "Trax") {
+      game_rule_set = RULE_SET_TRAX;
+      continue;
+    }
+    if (line == "8x8 Trax" || line == "8x8Trax") {
+      game_rule_set = RULE_SET_TRAX_8X8;
+      continue;
+    }
+    if (line == "Loop Trax") {
+      game_rule_set = RULE_SET_LOOP_TRAX;
       continue;
     }
 
@@ -1479,7 +2830,7 @@ void ParseCommentedGames(const std::string& filename,
       game.moves.push_back(move);
 
       Position next_position;
-      position.DoMove(move, &next_position);
+      DoMoveByRuleSet(position, move, game_rule_set, &next_position);
       position.Swap(&next_position);
 
       if (position.finished()) {
@@ -1503,7 +2854,7 @@ void ParseCommentedGames(const std::string& filename,
   }
 
   if (!game.moves.empty()) {
-    if (game_kind == "Trax") {
+    if (game_rule_set == rule_set) {
       games->push_back(game);
     }
   }
@@ -1588,8 +2939,11 @@ void Book::Init(const std::vector<Game>& games, int max_steps) {
 
       // Only add moves that lead to the win of that player
       if ((i % 2 ? 1 : -1) == game.winner) {
-        // TODO(tetsui): Register all the rotated moves of this move.
-        books_[position.Hash()].push_back(move);
+        // The move is registered on the canonical position, so that it is
+        // also found from the rotated or reflected positions.
+        int symmetry = 0;
+        const PositionHash key = position.CanonicalHash(&symmetry);
+        books_[key].push_back(position.TransformMove(move, symmetry));
       }
 
       Position next_position;
@@ -1599,12 +2953,15 @@ void Book::Init(const std::vector<Game>& games, int max_steps) {
   }
 }
 
-bool Book::Select(const Position& position, Move *next_move) {
-  auto it = books_.find(position.Hash());
+bool Book::Select(const Position& position, RandomGenerator* random,
+                  Move *next_move) {
+  int symmetry = 0;
+  auto it = books_.find(position.CanonicalHash(&symmetry));
   if (it == books_.end()) {
     return false;
   }
-  *next_move = it->second[Random() % it->second.size()];
+  *next_move = position.InverseTransformMove(
+      it->second[random->Next() % it->second.size()], symmetry);
   return true;
 }
 
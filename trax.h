@@ -4,9 +4,9 @@
 #define TRAX_H_
 
 #include <algorithm>
-#include <bitset>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <map>
 #include <queue>
@@ -22,20 +22,77 @@ static const int kInf = 1000000000;
 
 // Be aware that pieces are defined in terms of anti-clockwise edge colors,
 // while y-axis of board index is flipped against mathematical definition.
-static const int kDx[] = {1, 0, -1, 0};
-static const int kDy[] = {0, -1, 0, 1};
+static constexpr int kDx[] = {1, 0, -1, 0};
+static constexpr int kDy[] = {0, -1, 0, 1};
+
+// Xoshiro128** pseudo random number generator.
+// The generator has no lock, so each thread should own its generator.
+// Generators with the same seed and the same stream return the same sequence,
+// and those with different streams return independent sequences.
+class RandomGenerator {
+ public:
+  // Seeded by --seed, with a new stream for each generator.
+  // The streams are numbered in the order of construction, so that runs are
+  // reproducible as long as the generators are constructed in the same order.
+  RandomGenerator();
+
+  RandomGenerator(uint64_t seed, uint64_t stream) {
+    Seed(seed, stream);
+  }
+
+  void Seed(uint64_t seed, uint64_t stream);
+
+  uint32_t Next() {
+    const uint32_t result = RotateLeft(state_[1] * 5, 7) * 9;
+    const uint32_t t = state_[1] << 9;
+    state_[2] ^= state_[0];
+    state_[3] ^= state_[1];
+    state_[1] ^= state_[2];
+    state_[0] ^= state_[3];
+    state_[2] ^= t;
+    state_[3] = RotateLeft(state_[3], 11);
+    return result;
+  }
+
+ private:
+  static uint32_t RotateLeft(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+  }
+
+  uint32_t state_[4];
+};
+
+// Variants of the rules of Trax.
+enum RuleSet {
+  // Trax on the unlimited board. A loop or a victory line wins.
+  RULE_SET_TRAX = 0,
 
-// Xorshift 128.
-uint32_t Random();
+  // Trax on the 8x8 board. The game is draw if the board is filled without
+  // any loop or victory line.
+  RULE_SET_TRAX_8X8,
 
-// Should be called before Position::GetPossiblePieces().
-void GeneratePossiblePiecesTable();
+  // Trax on the unlimited board, where only a loop wins.
+  RULE_SET_LOOP_TRAX,
 
-// Should be called before Position::TraceVictoryLineOrLoop().
-void GenerateTrackDirectionTable();
+  NUM_RULE_SETS
+};
+
+// Properties of the rule sets, which are constant at compile time.
+// Methods of Position that depend on the rules take the rule set as a
+// template parameter, so that the branches for the other rule sets are
+// removed from each instantiation.
+template <RuleSet rule_set>
+struct RuleSetTraits {
+  // The board is at most 8x8, and filling it is draw.
+  static const bool kLimitedBoard = rule_set == RULE_SET_TRAX_8X8;
+
+  // A victory line wins.
+  static const bool kVictoryLine = rule_set != RULE_SET_LOOP_TRAX;
+};
 
-// Should be called before Position::FillForcedPieces().
-void GenerateForcedPlayTable();
+// Rule set selected by --trax8x8 and --loop_trax.
+// The methods of Position without the template parameter follow it.
+RuleSet GetRuleSet();
 
 // Piece kinds. It includes color information so it is more specific than
 // Trax notation. The alphabets after the prefix specify colors on the edges
@@ -76,8 +133,8 @@ enum Piece : uint8_t {
   NUM_PIECES
 };
 
-// bitset for set of different kind of pieces.
-using PieceSet = std::bitset<NUM_PIECES>;
+// Set of different kind of pieces. Bit i is set if the piece i is included.
+using PieceSet = uint8_t;
 
 // Edge colors of the pieces as explained above.
 static const char* kPieceColors[] = {
@@ -90,6 +147,18 @@ static const char* kPieceColors[] = {
   "WWRR"
 };
 
+// Bitmask of the red edges of the pieces. Bit i is the edge in the direction
+// of (kDx[i], kDy[i]).
+static constexpr uint8_t kPieceRedEdges[] = {
+  0x0,
+  0x5,
+  0xa,
+  0x9,
+  0x3,
+  0x6,
+  0xc
+};
+
 // Trax notations of the pieces.
 static const char kPieceNotations[] = ".++/\\/\\";
 
@@ -213,11 +282,14 @@ struct Line {
     loop_distances[1] = 0;
   }
 
+  // endpoint_index_a and endpoint_index_b are the clockwise indices of the
+  // endpoints among total_index external facing edges.
   Line(const std::pair<int, int>& endpoint_a,
        const std::pair<int, int>& endpoint_b,
        bool is_red,
        const Position& position,
-       const std::map<std::pair<int, int>, int>& indexed_edges,
+       int endpoint_index_a,
+       int endpoint_index_b,
        int total_index);
 
   void Dump() const {
@@ -253,11 +325,193 @@ struct Line {
   int endpoint_index_b;
 };
 
+// Largest width or height of the board, excluding the sentinels.
+// Moves that would grow the board beyond it are rejected as illegal.
+// Human played games in vendor/commented/ stay under 16x16.
+static const int kMaxBoardSize = 60;
+
+// Width and height of the board buffer, including the sentinels.
+static const int kBoardCapacity = kMaxBoardSize + 4;
+
+static_assert(kBoardCapacity == 64, "a column must fill bitplanes exactly");
+
+// Fixed-capacity backing store of Position's board.
+// It is sized once for the largest board, so growing the board never
+// allocates. Buffers are recycled through a per-thread pool.
+//
+// The board is laid out on a torus of kBoardCapacity by kBoardCapacity
+// cells, and Position keeps where its origin is. Growing the board to any
+// direction only moves the origin, and nothing in the buffer moves. Cells
+// out of the board are empty, so the sentinels are empty as well.
+// See Position::column() and Position::row().
+struct BoardBuffer {
+  // Pieces at [column * kBoardCapacity + row].
+  Piece cells[kBoardCapacity * kBoardCapacity];
+
+  // The same board as bitplanes. The row is the bit of the column.
+  // occupied has bits of non-empty cells, and red_edges[i] has bits of
+  // pieces whose edge in the direction (kDx[i], kDy[i]) is red.
+  uint64_t occupied[kBoardCapacity];
+  uint64_t red_edges[4][kBoardCapacity];
+
+  // Empty cells next to any piece, i.e. the cells where moves can be made,
+  // in the same layout as occupied.
+  uint64_t frontier[kBoardCapacity];
+
+  // Possible pieces of the frontier cells at [column][row]. Cells out of
+  // the frontier have stale values.
+  PieceSet possible_pieces[kBoardCapacity][kBoardCapacity];
+
+  // The other end of the line from each line end, i.e. the edge of a piece
+  // facing an empty cell. [column][row][i] is for the edge of the cell in
+  // the direction (kDx[i], kDy[i]). The other end is stored relative to
+  // the end. Edges that are not line ends have stale values.
+  uint16_t line_ends[kBoardCapacity][kBoardCapacity][4];
+
+  // Chains free buffers in the pool.
+  BoardBuffer* next_free;
+};
+
+// Largest number of moves Position::GenerateMoves() can return.
+// Moves are on the empty cells of the board and its border, and at most
+// three pieces are possible for a cell next to a single piece.
+static const int kMaxMoves = 3 * kBoardCapacity * kBoardCapacity;
+
+// Fixed-capacity list of moves. It is supposed to be kept on the stack, so
+// that generating moves never allocates.
+class MoveList {
+ public:
+  MoveList() : size_(0) {
+    // moves_ is left uninitialized.
+  }
+
+  void push_back(Move move) {
+    assert(size_ < kMaxMoves);
+    moves_[size_++] = move;
+  }
+
+  void emplace_back(int x, int y, Piece piece) {
+    push_back(Move(x, y, piece));
+  }
+
+  // Only shrinking is supported.
+  void resize(int size) {
+    assert(0 <= size && size <= size_);
+    size_ = size;
+  }
+
+  void clear() { size_ = 0; }
+
+  int size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  Move& operator[](int i) {
+    assert(0 <= i && i < size_);
+    return moves_[i];
+  }
+  const Move& operator[](int i) const {
+    assert(0 <= i && i < size_);
+    return moves_[i];
+  }
+
+  Move* begin() { return moves_; }
+  Move* end() { return moves_ + size_; }
+  const Move* begin() const { return moves_; }
+  const Move* end() const { return moves_ + size_; }
+
+ private:
+  int size_;
+
+  // Union so that the moves are not constructed.
+  union {
+    Move moves_[kMaxMoves];
+  };
+};
+
+// Take a buffer from the pool of the calling thread. The buffer is empty.
+// It only allocates when the pool is empty.
+BoardBuffer* AcquireBoardBuffer();
+
+// Return the buffer to the pool of the calling thread. nullptr is ignored.
+// The buffer has to be emptied by the caller.
+void ReleaseBoardBuffer(BoardBuffer* buffer);
+
+// Scratch buffers of Position::EnumerateLines(), reused across the calls on
+// the same thread. Cells are indexed same as BoardBuffer::cells, and the
+// entries are only valid if their stamps are equal to stamp, so that they
+// do not have to be cleared for each call.
+struct LineScratch {
+  LineScratch() : stamp(0) {
+  }
+
+  // Clockwise indices of the external facing edges.
+  int edge_indices[kBoardCapacity * kBoardCapacity];
+  uint32_t edge_stamps[kBoardCapacity * kBoardCapacity];
+
+  // The other endpoint of the line of the color (red if [1]) already
+  // emitted from the endpoint, as the cell index.
+  int emitted_lines[kBoardCapacity * kBoardCapacity][2];
+  uint32_t emitted_stamps[kBoardCapacity * kBoardCapacity][2];
+
+  uint32_t stamp;
+};
+
+// Scratch buffers of the forced plays of Position::DoMove() and
+// Position::MakeMove(), reused across the calls on the same thread in the
+// same way as LineScratch.
+struct ForcedPlayScratch {
+  ForcedPlayScratch() : stamp(0) {
+  }
+
+  // Ring buffer of the empty cells to check for forced plays. A cell is
+  // queued at most once at a time, so it never holds more than the cells
+  // of the board.
+  std::pair<int8_t, int8_t> queue[kBoardCapacity * kBoardCapacity];
+  uint32_t queued_stamps[kBoardCapacity * kBoardCapacity];
+
+  // Placed pieces to check for loops and victory lines. Each cell is placed
+  // at most once by a move.
+  std::pair<int8_t, int8_t> checkpoints[kBoardCapacity * kBoardCapacity];
+
+  // The tracks of the color (red if [1]) already traced by the checks. A
+  // line gives the same result from any of its cells, so it is traced only
+  // once.
+  uint32_t traced_stamps[kBoardCapacity * kBoardCapacity][2];
+
+  uint32_t stamp;
+};
+
+static_assert(kMaxBoardSize * kMaxBoardSize < kBoardCapacity * kBoardCapacity,
+              "forced plays must fit in the scratch buffers");
+
+// Colors of the edges facing an empty cell from its four neighbors.
+// Bit 2i is set if there is a piece in the direction (kDx[i], kDy[i]), and
+// bit 2i + 1 is set if its edge facing the cell is red.
+// Possible pieces only depend on the colors, so this is smaller than
+// NeighborKey which encodes the neighboring pieces themselves.
+using EdgeKey = uint8_t;
+
 // Integer hash of position. Can be used for transposition table, etc.
 // Needless to say, user must care about conflicts.
 using PositionHash = uint64_t;
 
-const PositionHash kPositionHashPrime = 100000007ULL;
+// Mixed into the hash when red is the side to move.
+const PositionHash kZobristRedToMove = 0x9e3779b97f4a7c15ULL;
+
+// Symmetries of a position, used by Position::CanonicalHash().
+// The board is transposed first, then flipped along each axis. Swapping the
+// colors also swaps the side to move, so the positions related by any of
+// them have the same score for the side to move.
+const int kSymmetryFlipX = 1;
+const int kSymmetryFlipY = 2;
+const int kSymmetryTranspose = 4;
+const int kSymmetrySwapColors = 8;
+
+// Rotations and reflections of the board.
+const int kNumBoardSymmetries = 8;
+
+// Including the color swap.
+const int kNumSymmetries = 16;
 
 // Denote a board configuration, or Position.
 class Position {
@@ -265,9 +519,13 @@ class Position {
   // Constructor to create empty Trax board.
   Position()
       : board_(nullptr)
+      , origin_x_(0)
+      , origin_y_(0)
       , max_x_(0)
       , max_y_(0)
+      , num_pieces_(0)
       , red_to_move_(false)  // White places first.
+      , keys_()
       , red_winner_(false)
       , white_winner_(false)
       , red_winning_reason_(WINNING_REASON_UNKNOWN)
@@ -283,7 +541,7 @@ class Position {
 
   // Destructor.
   ~Position() {
-    delete[] board_;
+    ReleaseBoard();
   }
 
   // Return possible moves. They may include illegal moves.
@@ -291,8 +549,65 @@ class Position {
   // forced plays. See FillForcedPieces().
   std::vector<Move> GenerateMoves() const;
 
+  // Same as above, but the moves are stored to the given list, which is
+  // cleared first. This does not allocate.
+  //
+  // This and the methods below follow the rules of GetRuleSet(). The
+  // overloads with the template parameter follow the given rule set
+  // instead, and searchers use them not to check the rules on every call.
+  void GenerateMoves(MoveList* moves) const;
+  template <RuleSet rule_set>
+  void GenerateMoves(MoveList* moves) const;
+
+  // Same as GenerateMoves(), but illegal moves are excluded by
+  // IsLegalMove().
+  void GenerateLegalMoves(MoveList* moves) const;
+  template <RuleSet rule_set>
+  void GenerateLegalMoves(MoveList* moves) const;
+
+  // Same as GenerateLegalMoves(), but only the first one of the moves that
+  // result in the same position is kept. Different moves often result in
+  // the same position by forced plays, and searchers do not have to expand
+  // them twice.
+  void GenerateUniqueMoves(MoveList* moves) const;
+  template <RuleSet rule_set>
+  void GenerateUniqueMoves(MoveList* moves) const;
+
+  // Return true if GenerateMoves() would generate the move. This is O(1),
+  // so that moves from elsewhere, e.g. the transposition table, can be
+  // checked before they are passed to IsLegalMove() without generating all
+  // the moves.
+  bool IsPossibleMove(Move move) const;
+  template <RuleSet rule_set>
+  bool IsPossibleMove(Move move) const;
+
+  // Return true if the move is legal, i.e. DoMove() and MakeMove() would
+  // succeed. The forced plays are simulated on a few cells around the move
+  // without touching the board, so this is cheaper than trying the move.
+  // Hash() of the resulting position is stored to hash if it is not nullptr
+  // and the move is legal.
+  bool IsLegalMove(Move move, PositionHash* hash = nullptr) const;
+  template <RuleSet rule_set>
+  bool IsLegalMove(Move move, PositionHash* hash = nullptr) const;
+
   // Return true if the move is legal.
   bool DoMove(Move move, Position *next_position) const;
+  template <RuleSet rule_set>
+  bool DoMove(Move move, Position *next_position) const;
+
+  // Apply the move to the position in place. Return true if the move is
+  // legal, otherwise the position is left unchanged.
+  // The change is recorded on the undo stack, so that it costs O(changed
+  // cells) instead of copying the whole board.
+  bool MakeMove(Move move);
+  template <RuleSet rule_set>
+  bool MakeMove(Move move);
+
+  // Revert the last move applied by MakeMove().
+  void UnmakeMove();
+
+  // Copy the position. The undo stack is not copied.
+  void CopyTo(Position* to) const;
 
   // Return set of pieces that are possible to be put on the given coordinate
   // based on neighboring edge colors.
@@ -301,41 +616,65 @@ class Position {
   PieceSet GetPossiblePieces(int x, int y) const;
 
   // Hash current board configuration.
-  // Current implementation uses simple rolling hash.
+  // The Zobrist key is maintained incrementally by DoMove() and MakeMove(),
+  // so this is O(1). It does not change when the board grows to the left or
+  // top. The key is mixed by the finalizer of MurmurHash3, so that the low
+  // bits are also usable as an index of TranspositionTable.
   PositionHash Hash() const {
-    PositionHash result = 0;
-    result += red_to_move_;
-    result *= kPositionHashPrime;
-    result += max_x_;
-    result *= kPositionHashPrime;
-    result += max_y_;
-
-    for (int i_x = 0; i_x < max_x_; ++i_x) {
-      for (int j_y = 0; j_y < max_y_; ++j_y) {
-        result *= kPositionHashPrime;
-        result += at(i_x, j_y);
-      }
-    }
-    return result;
+    return FinalizeKey(keys_[0], red_to_move_);
   }
 
+  // Same as above, but the positions equivalent by the symmetries are hashed
+  // to the same value. The keys of all the rotated and reflected boards are
+  // maintained incrementally as well, and the minimum one is taken.
+  // The symmetry from this position to the canonical one is stored to
+  // symmetry if it is not nullptr. Use it with TransformMove() and
+  // InverseTransformMove() to share moves among the equivalent positions.
+  PositionHash CanonicalHash(int* symmetry = nullptr) const;
+
+  // Map the move on this position to the one on the position transformed by
+  // the symmetry.
+  Move TransformMove(Move move, int symmetry) const;
+
+  // Map the move on the position transformed by the symmetry back to the one
+  // on this position.
+  Move InverseTransformMove(Move move, int symmetry) const;
+
   void EnumerateLines(std::vector<Line> *lines) const;
 
   // Swap
   void Swap(Position* to) {
     std::swap(board_, to->board_);
+    std::swap(origin_x_, to->origin_x_);
+    std::swap(origin_y_, to->origin_y_);
     std::swap(max_x_, to->max_x_);
     std::swap(max_y_, to->max_y_);
+    std::swap(num_pieces_, to->num_pieces_);
     std::swap(red_to_move_, to->red_to_move_);
+    std::swap(keys_, to->keys_);
     std::swap(red_winner_, to->red_winner_);
     std::swap(white_winner_, to->white_winner_);
     std::swap(red_winning_reason_, to->red_winning_reason_);
     std::swap(white_winning_reason_, to->white_winning_reason_);
+    undo_stack_.swap(to->undo_stack_);
+    placed_cells_.swap(to->placed_cells_);
   }
 
   void Clear() {
-    Position position;
-    Swap(&position);
+    ReleaseBoard();
+    origin_x_ = 0;
+    origin_y_ = 0;
+    max_x_ = 0;
+    max_y_ = 0;
+    num_pieces_ = 0;
+    red_to_move_ = false;
+    std::fill(keys_, keys_ + kNumBoardSymmetries, 0);
+    red_winner_ = false;
+    white_winner_ = false;
+    red_winning_reason_ = WINNING_REASON_UNKNOWN;
+    white_winning_reason_ = WINNING_REASON_UNKNOWN;
+    undo_stack_.clear();
+    placed_cells_.clear();
   }
 
   // Debug output.
@@ -373,15 +712,23 @@ class Position {
   // [0, max_x) and [0, max_y) holds, but sentinels are used,
   // so additional bounary access [-2, +2] is also allowed.
   const Piece at(int x, int y) const {
-    assert(-2 <= x && x < max_x_ + 2 && -2 <= y && y < max_y_ + 2);
-    assert((x + 2) * (max_y_ + 4) + (y + 2) >= 0);
-    assert((x + 2) * (max_y_ + 4) + (y + 2) < (max_y_ + 4) * (max_x_ + 4));
     assert(board_ != nullptr);
-    return board_[(x + 2) * (max_y_ + 4) + (y + 2)];
+    return board_->cells[index(x, y)];
   }
 
   int max_x() const { return max_x_; }
   int max_y() const { return max_y_; }
+  int num_pieces() const { return num_pieces_; }
+
+  // Return true if the move is out of the board of 8x8 Trax, i.e. on the
+  // border of the board that is already 8 cells long.
+  // GenerateMoves() never generates such moves, so the overloads of DoMove(),
+  // MakeMove() and IsLegalMove() with the template parameter do not check
+  // them. Check moves from the outside, e.g. of the opponent, by this.
+  bool IsOutOfLimitedBoard(Move move) const {
+    return (max_x_ >= 8 && (move.x == -1 || move.x == max_x_)) ||
+        (max_y_ >= 8 && (move.y == -1 || move.y == max_y_));
+  }
 
   // Return true if red is the side to move for the NEXT turn,
   // i.e. if red_to_move() == true, the last player that put a piece is white.
@@ -419,62 +766,265 @@ class Position {
   }
 
  private:
+  // A piece placed by MakeMove(), with the frontier around it before the
+  // placement, so that UnmakeMove() restores it without computing it.
+  struct PlacedCell {
+    int8_t x;
+    int8_t y;
+
+    // Bit i is the frontier bit of the neighbor in the direction
+    // (kDx[i], kDy[i]), and bit 4 is the one of the cell itself.
+    uint8_t frontier;
+
+    // Possible pieces of the neighbors.
+    PieceSet possible_pieces[4];
+  };
+
   // Fill forced play pieces. Return true if placements are successful,
   // i.e. the position is still legal after forced plays.
   // This also fills winner flags internally.
-  // This is only called from DoMove().
-  bool FillForcedPieces(int move_x, int move_y);
+  // The placed pieces are appended to placed_cells if it is
+  // not nullptr, even if it fails.
+  // This is only called from DoMove() and MakeMove().
+  template <RuleSet rule_set>
+  bool FillForcedPieces(int move_x, int move_y,
+                        std::vector<PlacedCell> *placed_cells);
+
+  // Change the board size in place. Existing pieces are moved by
+  // (offset_x, offset_y), which only moves the origin. The pieces have to
+  // be inside of the resized board.
+  void Resize(int max_x, int max_y, int offset_x, int offset_y) {
+    origin_x_ = (origin_x_ - offset_x) & (kBoardCapacity - 1);
+    origin_y_ = (origin_y_ - offset_y) & (kBoardCapacity - 1);
+    max_x_ = max_x;
+    max_y_ = max_y;
+  }
+
+  // Copy the board to the board of the position, which may have another
+  // board.
+  void CopyBoardTo(Position* to) const;
+
+  // Empty the cells and the bitplanes of the board, so that the buffer can
+  // be returned to the pool or can hold another board.
+  void ClearBoard();
+
+  // Same as ClearBoard(), and return the buffer to the pool.
+  void ReleaseBoard();
 
   // Fill winner flags based on the previously updated piece.
   // Updated variables are red_winner_ and white_winner_.
-  // This is only called from FillForcedPieces().
-  void FillWinnerFlags(int x, int y);
+  // This is only called from FinalizeWinnerFlags(), to cross-check the
+  // flags filled by PutPiece(). Lines already traced in scratch are skipped.
+  template <RuleSet rule_set>
+  void FillWinnerFlags(int x, int y, ForcedPlayScratch* scratch);
+
+  // Apply the rules after the pieces of a move are placed to the winner
+  // flags filled by PutPiece(): resolve the unknown winning reasons by
+  // tracing the lines from the checkpoints, give the win to the player who
+  // made the last move if both players won, and make a full 8x8 board a
+  // draw. Called from FillForcedPieces() and PackedBoard::Unpack().
+  template <RuleSet rule_set>
+  void FinalizeWinnerFlags(const std::pair<int8_t, int8_t>* checkpoints,
+                           int num_checkpoints, ForcedPlayScratch* scratch);
+
+  // Connect the track of the piece at (x, y) between the edges in
+  // directions (bitmask of two directions) to the lines next to it, by
+  // updating BoardBuffer::line_ends. Return the winning reason if the
+  // connected line is a loop or a victory line.
+  template <RuleSet rule_set>
+  WinningReason LinkLineEnds(int x, int y, int directions);
+
+  // Undo LinkLineEnds(). The piece at (x, y) has to be the last one placed.
+  void UnlinkLineEnds(int x, int y, int directions);
 
   // Return winning reason if the line of the given color starts from (x, y)
   // constitutes victory line or loop, i.e. the given color wins.
+  // The traced cells are stamped in scratch.
+  template <RuleSet rule_set>
   WinningReason TraceVictoryLineOrLoop(int start_x, int start_y,
-                                       bool red_line);
-
-  void TraceLineToEndpoints(int x, int y, bool red_line,
-                            std::pair<int, int> *endpoint_a,
-                            std::pair<int, int> *endpoint_b) const;
+                                       bool red_line,
+                                       ForcedPlayScratch* scratch);
 
   // Trace external facing edges of the position in clockwise order and
   // enumerate all of them.
-  // Returns <coordinate, index> map. Total number of index is total_index.
+  // Fills scratch->edge_indices of the cells stamped by scratch->stamp.
+  // Total number of index is total_index.
   // The index may jump and some index may be lacking.
-  void TraceAndIndexEdges(
-      int start_x, int start_y,
-      std::map<std::pair<int, int>, int> *indexed_edges,
-      int *total_index) const;
+  void TraceAndIndexEdges(int start_x, int start_y, LineScratch *scratch,
+                          int *total_index) const;
 
   // Reference access to board is only allowed from other instances of the
   // class.
   Piece& at(int x, int y) {
-    assert(-2 <= x && x < max_x_ + 2 && -2 <= y && y < max_y_ + 2);
-    assert((x + 2) * (max_y_ + 4) + (y + 2) >= 0);
-    assert((x + 2) * (max_y_ + 4) + (y + 2) < (max_y_ + 4) * (max_x_ + 4));
     assert(board_ != nullptr);
-    return board_[(x + 2) * (max_y_ + 4) + (y + 2)];
+    return board_->cells[index(x, y)];
   }
 
-  // Board array size including sentinels. Used internally.
-  int board_size() const {
-    return (max_x_ + 4) * (max_y_ + 4);
+  // Column of the coordinate in BoardBuffer.
+  int column(int x) const {
+    assert(-2 <= x && x < max_x_ + 2);
+    return (x + origin_x_) & (kBoardCapacity - 1);
   }
 
-  Piece* board_;
+  // Row of the coordinate in BoardBuffer, i.e. the bit in the bitplanes.
+  int row(int y) const {
+    assert(-2 <= y && y < max_y_ + 2);
+    return (y + origin_y_) & (kBoardCapacity - 1);
+  }
+
+  // Bits of the column x of the bitplane, rotated so that bit (y + 2) is
+  // the row of y.
+  uint64_t column_bits(const uint64_t* plane, int x) const {
+    const int shift = (origin_y_ - 2) & (kBoardCapacity - 1);
+    const uint64_t bits = plane[column(x)];
+    return shift == 0 ? bits : (bits >> shift) | (bits << (64 - shift));
+  }
+
+  // Index of the coordinate in BoardBuffer::cells.
+  int index(int x, int y) const {
+    return column(x) * kBoardCapacity + row(y);
+  }
+
+  // Put the piece on the empty cell and update the Zobrist key, the
+  // bitplanes, the frontier around it and the line ends. Winner flags are
+  // set if it completes a loop or a victory line.
+  // The previous frontier is saved to placed_cell if it is not nullptr.
+  template <RuleSet rule_set>
+  void PutPiece(int x, int y, Piece piece, PlacedCell* placed_cell = nullptr);
+
+  // Remove the piece put by PutPiece(), and restore the frontier and the
+  // line ends.
+  // The pieces have to be removed in the reverse order.
+  // The Zobrist key is not updated.
+  void RemovePiece(const PlacedCell& placed_cell);
+
+  // Return EdgeKey of the empty cell from the bitplanes.
+  EdgeKey edge_key(int x, int y) const;
+
+
+  // Mix the side to move into the key by the finalizer of MurmurHash3.
+  static PositionHash FinalizeKey(PositionHash key, bool red_to_move) {
+    if (red_to_move) {
+      key ^= kZobristRedToMove;
+    }
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+  }
+
+  BoardBuffer* board_;
+
+  // Column and row in board_ where the cell (0, 0) is.
+  int origin_x_;
+  int origin_y_;
 
   int max_x_;
   int max_y_;
 
+  // Number of the pieces on the board, including forced plays.
+  int num_pieces_;
+
   bool red_to_move_;
 
+  // Zobrist keys of the pieces on the board, indexed by the symmetry of the
+  // board. keys_[0] is the one of this board. The side to move is not
+  // included. See kZobristXTable for its translation invariance.
+  PositionHash keys_[kNumBoardSymmetries];
+
   bool red_winner_;
   bool white_winner_;
 
   WinningReason red_winning_reason_;
   WinningReason white_winning_reason_;
+
+  // State before a move applied by MakeMove(), to be restored by
+  // UnmakeMove().
+  struct UndoRecord {
+    // Index of placed_cells_ where the pieces placed by the move begin.
+    int first_placed_cell;
+
+    // Board size before the move, and how much the origin was moved by
+    // growing the board to the left or top.
+    int max_x;
+    int max_y;
+    int offset_x;
+    int offset_y;
+
+    PositionHash keys[kNumBoardSymmetries];
+
+    bool red_winner;
+    bool white_winner;
+    WinningReason red_winning_reason;
+    WinningReason white_winning_reason;
+  };
+
+  std::vector<UndoRecord> undo_stack_;
+
+  // Coordinates of the pieces placed by the moves on the undo stack,
+  // including forced plays.
+  std::vector<PlacedCell> placed_cells_;
+
+  friend class PackedBoard;
+};
+
+// Compact copy of the board of a position, to store many positions, e.g.
+// the positions of game records. Pieces fit in 4 bits, so two cells are
+// packed into a byte, and the sentinels and the tables of Position are not
+// stored. A position of the board takes about a half of max_x * max_y
+// bytes, while BoardBuffer is sized for the largest board.
+class PackedBoard {
+ public:
+  PackedBoard() : max_x_(0), max_y_(0), red_to_move_(false) {
+  }
+
+  explicit PackedBoard(const Position& position) {
+    Pack(position);
+  }
+
+  // Store the board of the position.
+  void Pack(const Position& position);
+
+  // Restore the position. The Zobrist keys, the lines and the winner flags
+  // are computed again from the pieces, so this costs O(pieces).
+  void Unpack(Position* position) const;
+
+  // Return piece kind at the given coordinate in [0, max_x) and [0, max_y).
+  Piece at(int x, int y) const {
+    assert(0 <= x && x < max_x_ && 0 <= y && y < max_y_);
+    const int i = x * max_y_ + y;
+    return static_cast<Piece>((cells_[i >> 1] >> ((i & 1) << 2)) & 0xf);
+  }
+
+  int max_x() const { return max_x_; }
+  int max_y() const { return max_y_; }
+  bool red_to_move() const { return red_to_move_; }
+
+  // Return the number of bytes used by the packed cells.
+  size_t packed_size() const { return cells_.size(); }
+
+  bool operator==(const PackedBoard& to) const {
+    return max_x_ == to.max_x_ && max_y_ == to.max_y_ &&
+        red_to_move_ == to.red_to_move_ && cells_ == to.cells_;
+  }
+
+  bool operator!=(const PackedBoard& to) const {
+    return !(*this == to);
+  }
+
+ private:
+  template <RuleSet rule_set>
+  void Unpack(Position* position) const;
+
+  uint8_t max_x_;
+  uint8_t max_y_;
+  bool red_to_move_;
+
+  // Cell i = x * max_y + y is at the lower bits of [i / 2] if i is even,
+  // and at the upper bits otherwise.
+  std::vector<uint8_t> cells_;
 };
 
 // Base abstract class for searchers.
@@ -568,8 +1118,10 @@ void StartMultipleSelfGames(Searcher* white_searcher, Searcher* red_searcher,
 // Parse commented games.
 // High quality commented game data can be obtained from
 // http://www.traxgame.com/games_comment.php .
+// Only the games of the given rule set are returned.
 void ParseCommentedGames(const std::string& filename,
-                         std::vector<Game> *games);
+                         std::vector<Game> *games,
+                         RuleSet rule_set = RULE_SET_TRAX);
 
 // Book data.
 class Book {
@@ -581,10 +1133,13 @@ class Book {
   // max_steps specifies maximum steps to remember the next move.
   void Init(const std::vector<Game>& games, int max_steps = 3);
 
-  // Return true if found.
-  bool Select(const Position& position, Move *next_move);
+  // Return true if found. One of the book moves is selected by the random
+  // generator.
+  bool Select(const Position& position, RandomGenerator* random,
+              Move *next_move);
 
  private:
+  // Moves on the canonical positions, keyed by Position::CanonicalHash().
   std::unordered_map<PositionHash, std::vector<Move>> books_;
 };
 
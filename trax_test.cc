@@ -1,8 +1,14 @@
 // Copyright (C) 2016 Tetsui Ohkubo.
 
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <set>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -12,6 +18,61 @@
 #include "./timer.h"
 #include "./trax.h"
 
+DECLARE_int32(perft_hash_size_lg);
+DECLARE_int32(perft_threads);
+DECLARE_bool(trax8x8);
+
+namespace {
+
+// Heap allocations made by the thread, counted by operator new below.
+thread_local uint64_t g_allocation_count = 0;
+
+}  // namespace
+
+// Replaced in the tests to count the allocations in any build, including
+// the ones with NDEBUG. The searchers are linked into the test with the
+// same build flags as trax. The operators are not inlined, so that GCC does
+// not take the malloc() and the free() in them for a mismatch.
+__attribute__((noinline))
+void* operator new(std::size_t size) {
+  ++g_allocation_count;
+  void* pointer = std::malloc(size == 0 ? 1 : size);
+  if (pointer == nullptr) {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+__attribute__((noinline))
+void operator delete(void* pointer) noexcept {
+  std::free(pointer);
+}
+
+__attribute__((noinline))
+void operator delete(void* pointer, std::size_t size) noexcept {
+  std::free(pointer);
+}
+
+__attribute__((noinline))
+void* operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+__attribute__((noinline))
+void operator delete[](void* pointer) noexcept {
+  std::free(pointer);
+}
+
+__attribute__((noinline))
+void operator delete[](void* pointer, std::size_t size) noexcept {
+  std::free(pointer);
+}
+
+// Number of the heap allocations made by the calling thread.
+uint64_t GetAllocationCount() {
+  return g_allocation_count;
+}
+
 void SupplyNotations(const std::vector<std::string>& notations,
                      Position *position) {
   for (const std::string& notation : notations) {
@@ -23,19 +84,17 @@ void SupplyNotations(const std::vector<std::string>& notations,
   }
 }
 
-using NeighborKey = uint32_t;
-extern NeighborKey EncodeNeighborKey(int right, int top, int left, int bottom);
-extern PieceSet g_possible_pieces_table[1 << 12];
+extern PieceSet GetPossiblePiecesOfNeighbors(int right, int top, int left,
+                                             int bottom);
 
 TEST(PossiblePieceTest, NoHitForInvalidPlace) {
   //  /
   // / +
   //  /
-  NeighborKey key = EncodeNeighborKey(PIECE_WRWR,
-                                      PIECE_WRRW,
-                                      PIECE_RWWR,
-                                      PIECE_RWWR);
-  ASSERT_EQ(PieceSet(), g_possible_pieces_table[key]);
+  ASSERT_EQ(0, GetPossiblePiecesOfNeighbors(PIECE_WRWR,
+                                            PIECE_WRRW,
+                                            PIECE_RWWR,
+                                            PIECE_RWWR));
 }
 
 TEST(MoveTest, PutInitialPiece) {
@@ -147,6 +206,29 @@ TEST(PositionTest, WinByVerticalVictoryLineSimple) {
   ASSERT_EQ(WINNING_REASON_LINE, position.winning_reason());
 }
 
+TEST(PositionTest, NoVictoryLineInLoopTrax) {
+  Position position;
+  for (const char* notation :
+       {"@0+", "B1+", "C1+", "D1+", "E1+", "F1+", "G1+", "H1+"}) {
+    ASSERT_TRUE(position.MakeMove<RULE_SET_LOOP_TRAX>(
+        Move(notation, position)));
+  }
+  ASSERT_FALSE(position.finished());
+
+  // The same moves make a victory line in Trax.
+  position.UnmakeMove();
+  ASSERT_TRUE(position.MakeMove<RULE_SET_TRAX>(Move("H1+", position)));
+  ASSERT_EQ(WINNING_REASON_LINE, position.winning_reason());
+
+  // Loops still win.
+  Position loop_position;
+  for (const char* notation : {"@0/", "B1\\", "A2\\"}) {
+    ASSERT_TRUE(loop_position.MakeMove<RULE_SET_LOOP_TRAX>(
+        Move(notation, loop_position)));
+  }
+  ASSERT_EQ(WINNING_REASON_LOOP, loop_position.winning_reason());
+}
+
 TEST(PositionTest, NotVerticalVictoryLineSimple) {
   Position position;
   SupplyNotations({"@0+", "A2+", "A3+", "A4+", "A5+", "A6+", "A7+", "A8/"},
@@ -247,6 +329,484 @@ TEST(PositionTest, WinByHorizontalVictoryLineBecauesRightmost) {
   ASSERT_EQ(WINNING_REASON_LINE, position.winning_reason());
 }
 
+TEST(PositionTest, DoMoveIntoReusedPosition) {
+  Position position;
+  SupplyNotations({"@0/", "B1\\"}, &position);
+
+  // The board buffer and the winner flags of next_position are reused.
+  Position next_position;
+  ASSERT_TRUE(position.DoMove(Move("A2\\", position), &next_position));
+  ASSERT_TRUE(next_position.finished());
+  Move move("A2/", position);
+  ASSERT_TRUE(position.DoMove(move, &next_position));
+  ASSERT_FALSE(next_position.finished());
+  ASSERT_EQ(move.piece, static_cast<const Position&>(next_position).at(0, 1));
+}
+
+TEST(PositionTest, MakeMoveMatchesDoMoveAndUnmakeMoveRestores) {
+  Position position;
+  SupplyNotations(
+      {"@0+", "B1/", "C1/", "A2/", "A3+", "A4/", "B4+", "C4/"}, &position);
+  const PositionHash original_hash = position.Hash();
+
+  for (Move move : position.GenerateMoves()) {
+    Position next_position;
+    const bool legal = position.DoMove(move, &next_position);
+    ASSERT_EQ(legal, position.MakeMove(move));
+    if (legal) {
+      ASSERT_EQ(next_position.Hash(), position.Hash());
+      ASSERT_EQ(next_position.winner(), position.winner());
+      position.UnmakeMove();
+    }
+    ASSERT_EQ(original_hash, position.Hash());
+  }
+}
+
+TEST(PositionTest, GenerateMovesToMoveList) {
+  Position position;
+  MoveList moves;
+  position.GenerateMoves(&moves);
+  ASSERT_EQ(2, moves.size());
+  ASSERT_EQ(Move("@0/", position), moves[0]);
+  ASSERT_EQ(Move("@0+", position), moves[1]);
+
+  SupplyNotations({"@0+", "B1/", "C1/", "A2/"}, &position);
+  position.GenerateMoves(&moves);
+  const std::vector<Move> expected_moves = position.GenerateMoves();
+  ASSERT_EQ(expected_moves,
+            std::vector<Move>(moves.begin(), moves.end()));
+}
+
+TEST(PositionTest, HashIsTranslationInvariant) {
+  // Same pieces, but the board grows to the right for one, and to the left
+  // for the other.
+  Position position_a;
+  SupplyNotations({"@0+", "B1+", "C1/"}, &position_a);
+  Position position_b;
+  SupplyNotations({"@0+", "@1+", "C1/"}, &position_b);
+
+  ASSERT_EQ(position_a.Hash(), position_b.Hash());
+  const Position& board_a = position_a;
+  const Position& board_b = position_b;
+  for (int i_x = 0; i_x < board_a.max_x(); ++i_x) {
+    for (int j_y = 0; j_y < board_a.max_y(); ++j_y) {
+      ASSERT_EQ(board_a.at(i_x, j_y), board_b.at(i_x, j_y));
+    }
+  }
+
+  Position position_c;
+  SupplyNotations({"@0+", "B1+", "C1\\"}, &position_c);
+  ASSERT_NE(position_a.Hash(), position_c.Hash());
+}
+
+TEST(PositionTest, CanonicalHashIsSymmetric) {
+  std::vector<Game> games;
+  ParseCommentedGames("./vendor/commented/Comment.txt", &games);
+  ASSERT_FALSE(games.empty());
+
+  // Replay the games rotated and reflected. The canonical hashes should be
+  // same at every move, and the moves should be mapped back.
+  for (int i = 0; i < std::min<int>(games.size(), 20); ++i) {
+    for (int symmetry = 0; symmetry < kNumBoardSymmetries; ++symmetry) {
+      Position position;
+      Position transformed;
+      for (Move move : games[i].moves) {
+        const Move transformed_move = position.TransformMove(move, symmetry);
+        ASSERT_EQ(move, position.InverseTransformMove(transformed_move,
+                                                      symmetry));
+        ASSERT_EQ(move, position.InverseTransformMove(
+            position.TransformMove(move, symmetry | kSymmetrySwapColors),
+            symmetry | kSymmetrySwapColors));
+
+        const bool legal = position.MakeMove(move);
+        ASSERT_EQ(legal, transformed.MakeMove(transformed_move));
+        if (!legal) {
+          break;
+        }
+        ASSERT_EQ(position.max_x() * position.max_y(),
+                  transformed.max_x() * transformed.max_y());
+        ASSERT_EQ(position.CanonicalHash(), transformed.CanonicalHash());
+        ASSERT_EQ(position.winner(), transformed.winner());
+      }
+    }
+  }
+
+  // Mirrored along the x axis.
+  Position position_a;
+  SupplyNotations({"@0+", "B1+", "C1/"}, &position_a);
+  Position position_b;
+  SupplyNotations({"@0+", "B1+", "C1\\"}, &position_b);
+  ASSERT_NE(position_a.Hash(), position_b.Hash());
+  ASSERT_EQ(position_a.CanonicalHash(), position_b.CanonicalHash());
+
+  // A straight piece is not a curve however it is transformed.
+  Position position_c;
+  SupplyNotations({"@0+"}, &position_c);
+  Position position_d;
+  SupplyNotations({"@0/"}, &position_d);
+  ASSERT_NE(position_c.CanonicalHash(), position_d.CanonicalHash());
+}
+
+TEST(PositionTest, GenerateMovesMatchesNeighborKeys) {
+  std::vector<Game> games;
+  ParseCommentedGames("./vendor/commented/Comment.txt", &games);
+  ASSERT_FALSE(games.empty());
+
+  // Moves generated from the bitplanes should be same as the ones from the
+  // pieces around every cell, including the order.
+  Position position;
+  ASSERT_TRUE(position.MakeMove(games[0].moves[0]));
+  for (int i = 1; i < games[0].num_moves(); ++i) {
+    const Position& board = position;
+    std::vector<Move> expected_moves;
+    for (int i_x = -1; i_x <= board.max_x(); ++i_x) {
+      for (int j_y = -1; j_y <= board.max_y(); ++j_y) {
+        if (board.at(i_x, j_y) != PIECE_EMPTY) {
+          continue;
+        }
+        const PieceSet pieces = GetPossiblePiecesOfNeighbors(
+            board.at(i_x + kDx[0], j_y + kDy[0]),
+            board.at(i_x + kDx[1], j_y + kDy[1]),
+            board.at(i_x + kDx[2], j_y + kDy[2]),
+            board.at(i_x + kDx[3], j_y + kDy[3]));
+        // Exclude EMPTY piece for added piece candidates.
+        for (int k = 1; k < NUM_PIECES; ++k) {
+          if ((pieces >> k) & 1) {
+            expected_moves.emplace_back(i_x, j_y, static_cast<Piece>(k));
+          }
+        }
+      }
+    }
+
+    ASSERT_EQ(expected_moves, position.GenerateMoves());
+    ASSERT_TRUE(position.MakeMove(games[0].moves[i]));
+  }
+}
+
+TEST(PositionTest, UnmakeMoveRestoresFrontier) {
+  std::vector<Game> games;
+  ParseCommentedGames("./vendor/commented/Comment.txt", &games);
+  ASSERT_FALSE(games.empty());
+
+  // The frontier is restored from the undo log, so trying every move should
+  // leave the generated moves unchanged.
+  Position position;
+  ASSERT_TRUE(position.MakeMove(games[0].moves[0]));
+  for (int i = 1; i < games[0].num_moves(); ++i) {
+    const std::vector<Move> moves = position.GenerateMoves();
+    for (Move move : moves) {
+      if (position.MakeMove(move)) {
+        position.UnmakeMove();
+      }
+      ASSERT_EQ(moves, position.GenerateMoves());
+    }
+    ASSERT_TRUE(position.MakeMove(games[0].moves[i]));
+  }
+}
+
+TEST(PositionTest, GenerateLegalMovesMatchesMakeMove) {
+  std::vector<Game> games;
+  ParseCommentedGames("./vendor/commented/Comment.txt", &games);
+  ASSERT_FALSE(games.empty());
+
+  // Legal moves found by the simulation should be exactly the ones
+  // MakeMove() accepts.
+  for (const Game& game : games) {
+    Position position;
+    for (Move game_move : game.moves) {
+      MoveList moves;
+      position.GenerateMoves(&moves);
+      MoveList expected_moves;
+      for (Move move : moves) {
+        if (position.MakeMove(move)) {
+          expected_moves.push_back(move);
+          position.UnmakeMove();
+        }
+      }
+
+      MoveList legal_moves;
+      position.GenerateLegalMoves(&legal_moves);
+      ASSERT_EQ(
+          std::vector<Move>(expected_moves.begin(), expected_moves.end()),
+          std::vector<Move>(legal_moves.begin(), legal_moves.end()));
+
+      if (!position.MakeMove(game_move)) {
+        break;
+      }
+    }
+  }
+}
+
+template <RuleSet rule_set>
+void ExpectPossibleMovesMatchGenerateMoves(const Position& position) {
+  MoveList moves;
+  position.GenerateMoves<rule_set>(&moves);
+  std::set<Move> generated_moves(moves.begin(), moves.end());
+  for (int x = -1; x <= position.max_x() + 2; ++x) {
+    for (int y = -1; y <= position.max_y() + 2; ++y) {
+      for (int piece = PIECE_EMPTY; piece < NUM_PIECES; ++piece) {
+        const Move move(x, y, static_cast<Piece>(piece));
+        ASSERT_EQ(generated_moves.count(move) > 0,
+                  position.IsPossibleMove<rule_set>(move))
+          << move.notation();
+      }
+    }
+  }
+}
+
+TEST(PositionTest, IsPossibleMoveMatchesGenerateMoves) {
+  std::vector<Game> games;
+  ParseCommentedGames("./vendor/commented/Comment.txt", &games);
+  ASSERT_FALSE(games.empty());
+  games.resize(std::min<size_t>(games.size(), 50));
+
+  for (const Game& game : games) {
+    Position position;
+    for (Move game_move : game.moves) {
+      ExpectPossibleMovesMatchGenerateMoves<RULE_SET_TRAX>(position);
+      // The moves out of 8x8 are not possible once the board is 8 long.
+      ExpectPossibleMovesMatchGenerateMoves<RULE_SET_TRAX_8X8>(position);
+      if (!position.MakeMove(game_move)) {
+        break;
+      }
+    }
+    ExpectPossibleMovesMatchGenerateMoves<RULE_SET_TRAX>(position);
+  }
+}
+
+TEST(PositionTest, GenerateUniqueMovesResultInDifferentPositions) {
+  std::vector<Game> games;
+  ParseCommentedGames("./vendor/commented/Comment.txt", &games);
+  ASSERT_FALSE(games.empty());
+
+  for (const Game& game : games) {
+    Position position;
+    for (Move game_move : game.moves) {
+      // Hashes of all the positions reachable by a legal move.
+      std::vector<PositionHash> expected_hashes;
+      MoveList legal_moves;
+      position.GenerateLegalMoves(&legal_moves);
+      for (Move move : legal_moves) {
+        PositionHash hash = 0;
+        ASSERT_TRUE(position.IsLegalMove(move, &hash));
+        ASSERT_TRUE(position.MakeMove(move));
+        ASSERT_EQ(position.Hash(), hash);
+        position.UnmakeMove();
+        expected_hashes.push_back(hash);
+      }
+      std::sort(expected_hashes.begin(), expected_hashes.end());
+      expected_hashes.erase(
+          std::unique(expected_hashes.begin(), expected_hashes.end()),
+          expected_hashes.end());
+
+      std::vector<PositionHash> hashes;
+      MoveList unique_moves;
+      position.GenerateUniqueMoves(&unique_moves);
+      for (Move move : unique_moves) {
+        ASSERT_TRUE(position.MakeMove(move));
+        hashes.push_back(position.Hash());
+        position.UnmakeMove();
+      }
+      std::sort(hashes.begin(), hashes.end());
+      ASSERT_EQ(expected_hashes, hashes);
+
+      if (!position.MakeMove(game_move)) {
+        break;
+      }
+    }
+  }
+}
+
+TEST(PositionTest, UnmakeMoveRestoresLineEnds) {
+  std::vector<Game> games;
+  ParseCommentedGames("./vendor/commented/Comment.txt", &games);
+  ASSERT_FALSE(games.empty());
+
+  // Winners found by the line ends should be same after any number of
+  // MakeMove() and UnmakeMove(), as the ones of DoMove() from a copy.
+  for (int i = 0; i < std::min<int>(games.size(), 20); ++i) {
+    Position position;
+    Position expected;
+    for (int j = 0; j < games[i].num_moves(); ++j) {
+      if (j > 0) {
+        for (Move move : position.GenerateMoves()) {
+          Position next;
+          const bool legal = expected.DoMove(move, &next);
+          ASSERT_EQ(legal, position.MakeMove(move));
+          if (legal) {
+            ASSERT_EQ(next.winner(), position.winner());
+            ASSERT_EQ(next.winning_reason(), position.winning_reason());
+            position.UnmakeMove();
+          }
+        }
+      }
+
+      Position next;
+      if (!expected.DoMove(games[i].moves[j], &next)) {
+        break;
+      }
+      expected.Swap(&next);
+      ASSERT_TRUE(position.MakeMove(games[i].moves[j]));
+      ASSERT_EQ(expected.winner(), position.winner());
+    }
+  }
+}
+
+TEST(PositionTest, GrowingBoardLeavesNoStalePieces) {
+  // Boards grow to every direction by moving the origin, and positions are
+  // copied into positions whose boards were somewhere else.
+  RandomGenerator random(1, 0);
+  Position copied;
+  Position next;
+  for (int i_game = 0; i_game < 20; ++i_game) {
+    Position position;
+    int num_moves = 0;
+    while (!position.finished()) {
+      std::vector<Move> moves = position.GenerateMoves();
+      Move move = moves[random.Next() % moves.size()];
+      Position previous;
+      position.CopyTo(&previous);
+      if (!previous.DoMove(move, &next)) {
+        ASSERT_FALSE(position.MakeMove(move));
+        continue;
+      }
+      ASSERT_TRUE(position.MakeMove(move));
+      position.CopyTo(&copied);
+      ++num_moves;
+
+      const Position& board = position;
+      for (const Position* other : {&copied, &next}) {
+        ASSERT_EQ(board.max_x(), other->max_x());
+        ASSERT_EQ(board.max_y(), other->max_y());
+        ASSERT_EQ(board.Hash(), other->Hash());
+        for (int x = -2; x < board.max_x() + 2; ++x) {
+          for (int y = -2; y < board.max_y() + 2; ++y) {
+            ASSERT_EQ(board.at(x, y), other->at(x, y));
+          }
+        }
+        ASSERT_EQ(board.GenerateMoves(), other->GenerateMoves());
+      }
+    }
+
+    for (int i = 0; i < num_moves; ++i) {
+      position.UnmakeMove();
+    }
+    ASSERT_EQ(0, position.max_x());
+    ASSERT_EQ(2, position.GenerateMoves().size());
+  }
+}
+
+TEST(PositionTest, DrawOnlyWhenTrax8x8BoardIsFull) {
+  RandomGenerator random(1, 0);
+  for (int i_game = 0; i_game < 300; ++i_game) {
+    Position position;
+    MoveList moves;
+    while (!position.finished()) {
+      position.GenerateLegalMoves<RULE_SET_TRAX_8X8>(&moves);
+      ASSERT_FALSE(moves.empty());
+      for (Move move : moves) {
+        ASSERT_FALSE(position.IsOutOfLimitedBoard(move));
+      }
+      ASSERT_TRUE(position.MakeMove<RULE_SET_TRAX_8X8>(
+          moves[random.Next() % moves.size()]));
+
+      const Position& board = position;
+      int num_pieces = 0;
+      for (int x = 0; x < board.max_x(); ++x) {
+        for (int y = 0; y < board.max_y(); ++y) {
+          num_pieces += board.at(x, y) != PIECE_EMPTY;
+        }
+      }
+      ASSERT_EQ(num_pieces, position.num_pieces());
+    }
+
+    if (position.winning_reason() == WINNING_REASON_FULL) {
+      ASSERT_EQ(0, position.winner());
+      ASSERT_EQ(64, position.num_pieces());
+    }
+  }
+}
+
+TEST(PackedBoardTest, UnpackRestoresPosition) {
+  std::vector<Game> games;
+  ParseCommentedGames("./vendor/commented/Comment.txt", &games);
+  ASSERT_FALSE(games.empty());
+
+  Position unpacked;
+  for (const Game& game : games) {
+    Position position;
+    for (Move move : game.moves) {
+      Position next_position;
+      ASSERT_TRUE(position.DoMove(move, &next_position));
+      position.Swap(&next_position);
+
+      const PackedBoard board(position);
+      ASSERT_EQ((position.max_x() * position.max_y() + 1) / 2,
+                board.packed_size());
+      const Position& original = position;
+      for (int x = 0; x < position.max_x(); ++x) {
+        for (int y = 0; y < position.max_y(); ++y) {
+          ASSERT_EQ(original.at(x, y), board.at(x, y));
+        }
+      }
+
+      board.Unpack(&unpacked);
+      ASSERT_EQ(position.Hash(), unpacked.Hash());
+      ASSERT_EQ(position.CanonicalHash(), unpacked.CanonicalHash());
+      ASSERT_EQ(position.finished(), unpacked.finished());
+      ASSERT_EQ(position.winner(), unpacked.winner());
+      ASSERT_EQ(position.winning_reason(), unpacked.winning_reason());
+      ASSERT_EQ(position.GenerateMoves(), unpacked.GenerateMoves());
+      ASSERT_TRUE(board == PackedBoard(unpacked));
+
+      std::vector<Line> lines;
+      std::vector<Line> unpacked_lines;
+      position.EnumerateLines(&lines);
+      unpacked.EnumerateLines(&unpacked_lines);
+      ASSERT_EQ(lines.size(), unpacked_lines.size());
+    }
+  }
+}
+
+TEST(PackedBoardTest, UnpackGivesWinToLastPlayerIfBothWon) {
+  // Same as VictoryIsLastPlayers1. The last move made loops of both players.
+  Position position;
+  SupplyNotations({"@0+", "B1\\", "B2/", "A2+", "A3/", "A0\\",
+                   "@3+", "@3\\", "B2+"},
+                  &position);
+  ASSERT_EQ(-1, position.winner());
+
+  Position unpacked;
+  PackedBoard(position).Unpack(&unpacked);
+  ASSERT_TRUE(unpacked.finished());
+  ASSERT_EQ(-1, unpacked.winner());
+  ASSERT_EQ(WINNING_REASON_LOOP, unpacked.winning_reason());
+}
+
+TEST(PackedBoardTest, UnpackRestoresTrax8x8Draw) {
+  RandomGenerator random(1, 0);
+  Position position;
+  while (position.winning_reason() != WINNING_REASON_FULL) {
+    position.Clear();
+    MoveList moves;
+    while (!position.finished()) {
+      position.GenerateLegalMoves<RULE_SET_TRAX_8X8>(&moves);
+      ASSERT_TRUE(position.MakeMove<RULE_SET_TRAX_8X8>(
+          moves[random.Next() % moves.size()]));
+    }
+  }
+  ASSERT_EQ(0, position.winner());
+
+  const bool trax8x8 = FLAGS_trax8x8;
+  FLAGS_trax8x8 = true;
+  Position unpacked;
+  PackedBoard(position).Unpack(&unpacked);
+  FLAGS_trax8x8 = trax8x8;
+  ASSERT_TRUE(unpacked.finished());
+  ASSERT_EQ(0, unpacked.winner());
+  ASSERT_EQ(WINNING_REASON_FULL, unpacked.winning_reason());
+}
+
 TEST(PositionTest, EnumerateLines1) {
   Position position;
   SupplyNotations({"@0+"}, &position);
@@ -422,6 +982,64 @@ TEST(PerftTest, PerftReturnsCorrectNumberIn4) {
   ASSERT_EQ(246888, Perft(5, &timer));
 }
 
+TEST(PerftTest, DivideMatchesReferenceWithThreads) {
+  const int num_threads = FLAGS_perft_threads;
+  FLAGS_perft_threads = 3;
+  for (int depth = 0; depth <= 5; ++depth) {
+    Timer timer(-1);
+    std::vector<std::pair<Move, uint64_t>> divide;
+    const uint64_t leaves = Perft(depth, &timer, &divide);
+
+    uint64_t expected_leaves = 0;
+    ASSERT_TRUE(GetPerftReference(RULE_SET_TRAX, depth, &expected_leaves));
+    ASSERT_EQ(expected_leaves, leaves);
+
+    // "@0/" and "@0+".
+    ASSERT_EQ(2, divide.size());
+    if (depth > 0) {
+      ASSERT_EQ(leaves, divide[0].second + divide[1].second);
+    }
+  }
+  FLAGS_perft_threads = num_threads;
+}
+
+TEST(PerftTest, HashedPerftMatchesReference) {
+  const int hash_size_lg = FLAGS_perft_hash_size_lg;
+  const int num_threads = FLAGS_perft_threads;
+  FLAGS_perft_threads = 2;
+  // The small table is overwritten all the time.
+  for (int size_lg : {4, 16}) {
+    FLAGS_perft_hash_size_lg = size_lg;
+    for (int depth = 0; depth <= 6; ++depth) {
+      Timer timer(-1);
+      uint64_t expected_leaves = 0;
+      ASSERT_TRUE(GetPerftReference(RULE_SET_TRAX, depth, &expected_leaves));
+      ASSERT_EQ(expected_leaves, Perft(depth, &timer));
+    }
+  }
+  FLAGS_perft_hash_size_lg = hash_size_lg;
+  FLAGS_perft_threads = num_threads;
+}
+
+TEST(PerftTest, ReferenceDiffersByRuleSetFromDepth9) {
+  for (int depth = 0; depth <= 9; ++depth) {
+    uint64_t trax_leaves = 0;
+    uint64_t trax8x8_leaves = 0;
+    uint64_t loop_trax_leaves = 0;
+    ASSERT_TRUE(GetPerftReference(RULE_SET_TRAX, depth, &trax_leaves));
+    ASSERT_TRUE(
+        GetPerftReference(RULE_SET_TRAX_8X8, depth, &trax8x8_leaves));
+    ASSERT_TRUE(
+        GetPerftReference(RULE_SET_LOOP_TRAX, depth, &loop_trax_leaves));
+    ASSERT_EQ(depth < 9, trax_leaves == trax8x8_leaves);
+    ASSERT_EQ(depth < 9, trax_leaves == loop_trax_leaves);
+  }
+
+  uint64_t leaves = 0;
+  ASSERT_FALSE(GetPerftReference(RULE_SET_TRAX, 10, &leaves));
+  ASSERT_FALSE(GetPerftReference(RULE_SET_TRAX, -1, &leaves));
+}
+
 TEST(TimerTest, Measure800Ms) {
   for (int i = 0; i < 10; ++i) {
     Timer timer(800);
@@ -432,21 +1050,168 @@ TEST(TimerTest, Measure800Ms) {
   }
 }
 
+TEST(RandomGeneratorTest, Streams) {
+  RandomGenerator random(1, 0);
+  RandomGenerator same_random(1, 0);
+  RandomGenerator other_stream_random(1, 1);
+  RandomGenerator other_seed_random(2, 0);
+
+  int num_same = 0;
+  int num_other_stream = 0;
+  int num_other_seed = 0;
+  for (int i = 0; i < 1000; ++i) {
+    const uint32_t value = random.Next();
+    num_same += value == same_random.Next();
+    num_other_stream += value == other_stream_random.Next();
+    num_other_seed += value == other_seed_random.Next();
+  }
+  ASSERT_EQ(1000, num_same);
+  ASSERT_EQ(0, num_other_stream);
+  ASSERT_EQ(0, num_other_seed);
+}
+
 TEST(RandomSearcherTest, OneTime) {
-  RandomSearcher random_searcher;
+  RandomSearcher<> random_searcher;
   Game game;
   StartSelfGame(&random_searcher, &random_searcher,
                 &game, /* verbose = */ false);
 }
 
 TEST(RandomSearcherTest, MultiTime) {
-  RandomSearcher random_searcher;
+  RandomSearcher<> random_searcher;
   std::vector<Game> games;
   StartMultipleSelfGames(&random_searcher, &random_searcher,
                          /* num_games = */ 100,  &games,
                          /* verbose = */ false);
 }
 
+TEST(SearchStackTest, NoAllocationAfterWarmUp) {
+  // The counter works in this build.
+  const uint64_t initial_count = GetAllocationCount();
+  std::unique_ptr<int> allocated(new int(0));
+  ASSERT_EQ(initial_count + 1, GetAllocationCount());
+
+  Position position;
+  SupplyNotations({"@0+", "B1+", "C1+", "B0/"}, &position);
+
+  NegaMaxSearcher<FactorEvaluator> factor_searcher(
+      2, /* iterative = */ true, /* use_book = */ false);
+  NegaMaxSearcher<LeafAverageEvaluator> leaf_average_searcher(
+      1, /* iterative = */ false, /* use_book = */ false);
+  for (Searcher* searcher : std::vector<Searcher*>{
+           &factor_searcher, &leaf_average_searcher}) {
+    // Warm up the search stack.
+    Timer warm_up_timer;
+    searcher->SearchBestMove(position, &warm_up_timer);
+
+    const uint64_t allocation_count = GetAllocationCount();
+    Timer timer;
+    searcher->SearchBestMove(position, &timer);
+    ASSERT_EQ(allocation_count, GetAllocationCount());
+  }
+}
+
+TEST(SearchStackTest, HistoryIsBoundedAndAgedByNewSearch) {
+  SearchStack stack;
+  const Move move(-1, 0, PIECE_RWRW);
+  const Move other_move(0, -1, PIECE_RWRW);
+  for (int i = 0; i < 1000; ++i) {
+    stack.UpdateHistory(move, SearchStack::kMaxHistory);
+    stack.UpdateHistory(other_move, -SearchStack::kMaxHistory / 2);
+  }
+  ASSERT_LE(stack.history(move), SearchStack::kMaxHistory);
+  ASSERT_GT(stack.history(move), SearchStack::kMaxHistory / 2);
+  ASSERT_GE(stack.history(other_move), -SearchStack::kMaxHistory);
+  ASSERT_LT(stack.history(other_move), 0);
+
+  stack.frame(3)->killers[0] = move;
+  const int history = stack.history(move);
+  stack.NewSearch();
+  ASSERT_EQ(history / 2, stack.history(move));
+  ASSERT_EQ(Move(), stack.frame(3)->killers[0]);
+}
+
+TEST(SearchRootMovesTest, WindowIsWidenedToFullWindow) {
+  Position position;
+  SupplyNotations({"@0+"}, &position);
+  MoveList legal_moves;
+  position.GenerateLegalMoves<RULE_SET_TRAX>(&legal_moves);
+  MoveList root_moves;
+  root_moves.push_back(legal_moves[0]);
+
+  // Fail low and fail high in turn until the window gets full. The delta
+  // is widened more times than it could be in int.
+  int num_searches = 0;
+  int last_alpha = 0;
+  int last_beta = 0;
+  auto search = [&](Position* next_position, int alpha, int beta) {
+    ++num_searches;
+    last_alpha = alpha;
+    last_beta = beta;
+    if (alpha == -kInf && beta == kInf) {
+      return 0;
+    }
+    const bool fail_low =
+        beta == kInf || (num_searches % 2 == 1 && alpha > -kInf);
+    return fail_low ? alpha : beta;
+  };
+
+  Timer timer(-1);
+  std::vector<ScoredMove> scored_moves;
+  int best_score = 1;
+  ASSERT_TRUE(SearchRootMoves<RULE_SET_TRAX>(
+      root_moves, kMaxAspirationScore - 1, /* aspiration = */ true,
+      /* check_timeout = */ false, &timer, &position, search, &scored_moves,
+      &best_score));
+  ASSERT_EQ(-kInf, last_alpha);
+  ASSERT_EQ(kInf, last_beta);
+  ASSERT_EQ(0, best_score);
+  ASSERT_LT(6, num_searches);
+  ASSERT_GT(20, num_searches);
+}
+
+TEST(NegaMaxSearcherTest, IterativeSearchFindsWinningMove) {
+  std::vector<Game> games;
+  ParseCommentedGames("./vendor/commented/Comment.txt", &games);
+  ASSERT_FALSE(games.empty());
+
+  NegaMaxSearcher<FactorEvaluator> searcher(
+      2, /* iterative = */ true, /* use_book = */ false);
+
+  // The positions before the last moves that won the games. The scores of
+  // the wins are out of the aspiration windows of the shallower depths.
+  int num_positions = 0;
+  for (const Game& game : games) {
+    if (game.moves.empty()) {
+      continue;
+    }
+    Position position;
+    for (int i = 0; i + 1 < static_cast<int>(game.moves.size()); ++i) {
+      ASSERT_TRUE(position.MakeMove(game.moves[i]));
+    }
+    if (position.finished()) {
+      continue;
+    }
+    const bool red_to_move = position.red_to_move();
+    Position last_position;
+    ASSERT_TRUE(position.DoMove(game.moves.back(), &last_position));
+    if (last_position.winner() != (red_to_move ? 1 : -1)) {
+      continue;
+    }
+
+    Timer timer;
+    Position next_position;
+    ASSERT_TRUE(position.DoMove(searcher.SearchBestMove(position, &timer),
+                                &next_position));
+    ASSERT_EQ(red_to_move ? 1 : -1, next_position.winner());
+
+    if (++num_positions >= 5) {
+      break;
+    }
+  }
+  ASSERT_GT(num_positions, 0);
+}
+
 TEST(ParseCommentedGameTest, Parse) {
   std::vector<Game> games;
   ParseCommentedGames("./vendor/commented/Comment.txt", &games);
@@ -455,6 +1220,17 @@ TEST(ParseCommentedGameTest, Parse) {
   ASSERT_EQ(277, games.size());
 }
 
+TEST(ParseCommentedGameTest, ParseLoopTrax) {
+  std::vector<Game> games;
+  ParseCommentedGames("./vendor/commented/Comment.txt", &games,
+                      RULE_SET_LOOP_TRAX);
+  // $ grep "^Loop Trax" vendor/commented/Comment.txt | wc -l
+  ASSERT_EQ(15, games.size());
+  for (const Game& game : games) {
+    ASSERT_NE(WINNING_REASON_LINE, game.winning_reason);
+  }
+}
+
 // TODO(tetsui): Do some kind of performance regression test,
 // because performance of basic operations are pretty important.
 
@@ -462,13 +1238,6 @@ TEST(ParseCommentedGameTest, Parse) {
 // facility?
 
 int main(int argc, char *argv[]) {
-  // Otherwise Position::GetPossiblePieces() doesn't work.
-  GeneratePossiblePiecesTable();
-  // Otherwise Position::TraceVictoryLineOrLoop() doesn't work.
-  GenerateTrackDirectionTable();
-  // Otherwise Position::FillForcedPieces() doesn't work.
-  GenerateForcedPlayTable();
-
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
 }